@@ -0,0 +1,412 @@
+#ifdef CLOTH_HEADLESS_EGL
+#include <glad/glad.h>
+#endif
+
+#include "../cloth_simulation_demo/cloth.h"
+#include "../cloth_simulation_demo/cloth_lod.h"
+#include "../cloth_simulation_demo/mesh_cloth.h"
+#include "../cloth_simulation_demo/philox.h"
+#include "../cloth_simulation_demo/recorder.h"
+#ifdef CLOTH_HEADLESS_EGL
+#include "../cloth_simulation_demo/culling.h"
+#include "../cloth_simulation_demo/egl_context.h"
+#include "../cloth_simulation_demo/shader.h"
+#endif
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Checks of the demo's building blocks that need no window, one line of results per check:
+//   ./cloth_simulation_check          runs all checks
+//   ./cloth_simulation_check sleep    runs the named ones
+// Builds with CLOTH_HEADLESS_EGL defined also check the OpenGL paths in an EGL context without a
+// window (Mesa llvmpipe is enough), run from the repository root so the shaders are found.
+
+static constexpr int ball_number = 5;
+static constexpr float ball_radius = 0.6 / ball_number;
+
+static bool report(const char* name, bool passed)
+{
+    std::cout << "check " << name << (passed ? " PASSED" : " FAILED") << std::endl;
+    return passed;
+}
+
+// a quiet tile next to a moving one stays awake and keeps its velocities, a quiet tile far
+// from it falls asleep after sleep_steps substeps
+static bool check_sleep()
+{
+    constexpr int n = 64;
+    using Sleep = Cloth_sleep<n, n>;
+    using Tiles = Sleep::Tiles;
+    auto cloth = std::make_unique<Cloth<n, n>>(1.0f / n);
+    cloth->initialize();
+    cloth->velocity.fill(Vector3<float>(0.f, 0.01f, 0.f));
+
+    Sleep sleep;
+    sleep.sleep_steps = 8;
+    const int moving = 1 * Tiles::cols + 1;
+    const int far_away = Tiles::count - 1;
+    bool passed = true;
+    for (int step = 0; step < 4 * sleep.sleep_steps; ++step)
+    {
+        for (int tile : sleep.collect_awake_tiles())
+        {
+            sleep.tile_speed[tile] = tile == moving ? 1.f : 0.f;
+            sleep.tile_residual[tile] = 0.f;
+        }
+        sleep.update(*cloth);
+    }
+
+    // neighbours before and after the moving tile in the order update visits them
+    for (int neighbour : { moving - 1, moving + 1, moving - Tiles::cols, moving + Tiles::cols + 1 })
+    {
+        passed = passed && sleep.is_awake(neighbour);
+        for (int j = Tiles::col_begin(neighbour); j != Tiles::col_end(neighbour); ++j)
+        {
+            for (int i = Tiles::row_begin(neighbour); i != Tiles::row_end(neighbour); ++i)
+                passed = passed && cloth->velocity.coeff(i, j).y() == 0.01f;
+        }
+    }
+    passed = passed && sleep.is_awake(moving) && !sleep.is_awake(far_away);
+    return report("sleep", passed);
+}
+
+// frames recorded the way main.cpp does with lod and record_normals on, read back: positions
+// within half a quantization step, normals of unit length and on average along those of the
+// full mesh, from which they differ only where the cloth folds over the balls
+static bool check_record()
+{
+    constexpr int n = 64;
+    const char* path = "./cloth_check_frames.bin";
+    auto cloth = std::make_unique<Cloth<n, n>>(1.0f / n);
+    Balls<ball_number> balls(ball_radius);
+    Philox random(1, 0);
+    cloth->initialize(random);
+    balls.initialize(random);
+    Adaptive_timestep<float> timestep(cloth->quad_size, 4e-2f / n);
+    Cloth_mesh<n, n> mesh, full_mesh;
+    Cloth_lod<n, n> lod;
+
+    const int frames = 60;
+    std::vector<Array<Vector3<float>, Dynamic, Dynamic>> positions, normals;
+    {
+        Frame_recorder<n, n> recorder(path, true, 1e-5f, 5);
+        for (int frame = 0; frame < frames; ++frame)
+        {
+            advance(*cloth, balls, 1.0f / 60, timestep);
+            lod.select(*cloth, glm::vec3(0.f, 0.f, 3.f), glm::radians(45.0f), 1024);
+            lod.pack_vertices(*cloth, mesh);
+            recorder.record(*cloth);
+
+            full_mesh.update_vertices(*cloth);
+            Array<Vector3<float>, Dynamic, Dynamic> normal(n, n);
+            for (int i = 0; i < n; ++i)
+            {
+                for (int j = 0; j < n; ++j)
+                {
+                    const float* vertex = full_mesh.vertices + 9 * (i * n + j);
+                    normal(i, j) = Vector3<float>(vertex[6], vertex[7], vertex[8]);
+                }
+            }
+            positions.push_back(cloth->position);
+            normals.push_back(normal);
+        }
+    }
+
+    Frame_reader reader(path);
+    bool passed = reader.is_open() && reader.has_normals() && reader.frame_count() == frames;
+    std::vector<float> position(3 * n * n), normal(3 * n * n);
+    float max_error = 0;
+    double alignment = 0;
+    int aligned = 0;
+    for (int frame = frames - 1; passed && frame >= 0; --frame)
+    {
+        passed = reader.read_frame(frame, position.data(), normal.data());
+        for (int i = 0; passed && i < n; ++i)
+        {
+            for (int j = 0; j < n; ++j)
+            {
+                int index = 3 * (i * n + j);
+                Vector3<float> x(position[index], position[index + 1], position[index + 2]);
+                Vector3<float> normal_ij(normal[index], normal[index + 1], normal[index + 2]);
+                max_error = std::max(max_error, (x - positions[frame](i, j)).cwiseAbs().maxCoeff());
+                passed = passed && std::abs(normal_ij.norm() - 1) < 2e-3f;
+                // the mesh leaves the normals of its border vertices zero
+                if (i > 0 && i < n - 1 && j > 0 && j < n - 1)
+                {
+                    alignment += normal_ij.dot(normals[frame](i, j).normalized());
+                    ++aligned;
+                }
+            }
+        }
+    }
+    std::remove(path);
+
+    alignment /= std::max(aligned, 1);
+    passed = passed && max_error <= 0.5e-5f * 1.01f && alignment > 0.99;
+    std::cout << "record grid " << n << "x" << n << " frames " << frames << " max_position_error " << max_error
+        << " mean_normal_alignment " << alignment << std::endl;
+    return report("record", passed);
+}
+
+// a grid written as an OBJ file of quads and loaded into Mesh_cloth falls like the grid cloth
+// while nothing touches it, holds still when external_force cancels gravity and drapes over
+// the balls without blowing up; building from an empty mesh is refused and repeated vertices are welded
+static bool check_mesh()
+{
+    constexpr int n = 32;
+    const char* path = "./cloth_check_mesh.obj";
+    const float quad_size = 1.0f / n;
+    {
+        std::ofstream obj(path);
+        for (int i = 0; i < n; ++i)
+        {
+            for (int j = 0; j < n; ++j)
+                obj << "v " << i * quad_size - 0.5f << " 0.6 " << j * quad_size - 0.5f << "\n";
+        }
+        for (int i = 0; i + 1 < n; ++i)
+        {
+            for (int j = 0; j + 1 < n; ++j)
+                obj << "f " << i * n + j + 1 << " " << (i + 1) * n + j + 1 << " " << (i + 1) * n + j + 2 << " " << i * n + j + 2 << "\n";
+        }
+    }
+    Mesh_cloth<float> mesh;
+    bool passed = mesh.load(path) && mesh.vertex_count() == n * n && mesh.triangle_count() == 2 * (n - 1) * (n - 1);
+    std::remove(path);
+    if (!passed)
+        return report("mesh", false);
+
+    Mesh_cloth<float> empty;
+    passed = !empty.build({}, {}) && !empty.build({ Vector3<float>::Zero() }, {}) && !empty.load(path)
+        && !empty.build({ Vector3<float>::Zero(), Vector3<float>::Zero(), Vector3<float>::Zero() }, { 0, 1, 2 });
+
+    // a quad whose two triangles repeat the vertices of their shared edge, as along a uv seam
+    Mesh_cloth<float> seam;
+    const Vector3<float> corners[4] = { { 0.f, 0.f, 0.f }, { quad_size, 0.f, 0.f }, { quad_size, 0.f, quad_size }, { 0.f, 0.f, quad_size } };
+    passed = passed && seam.build({ corners[0], corners[1], corners[2], corners[0], corners[2], corners[3] }, { 0, 1, 2, 3, 4, 5 })
+        && seam.vertex_count() == 4 && seam.triangle_count() == 2 && seam.min_edge_length > 0.f && seam.stable_dt() > 0.f;
+
+    // free fall, the balls far below
+    auto grid = std::make_unique<Cloth<n, n>>(quad_size);
+    for (int i = 0; i < n; ++i)
+    {
+        for (int j = 0; j < n; ++j)
+        {
+            grid->position(i, j) = Vector3<float>(i * quad_size - 0.5f, 0.6f, j * quad_size - 0.5f);
+            grid->velocity(i, j) = Vector3<float>::Zero();
+        }
+    }
+    Balls<ball_number> far_balls(ball_radius);
+    far_balls.center.fill(Vector3<float>(0.f, -100.f, 0.f));
+    const float dt = 0.8f * mesh.stable_dt();
+    float max_gap = 0;
+    for (int step = 0; step < 200; ++step)
+    {
+        substep(mesh, far_balls, dt);
+        substep(*grid, far_balls, dt);
+        Vector3<float> mesh_centroid(Vector3<float>::Zero()), grid_centroid(Vector3<float>::Zero());
+        for (int v = 0; v < mesh.vertex_count(); ++v)
+            mesh_centroid += mesh.position(v) / (n * n);
+        for (int i = 0; i < n; ++i)
+        {
+            for (int j = 0; j < n; ++j)
+                grid_centroid += grid->position(i, j) / (n * n);
+        }
+        max_gap = std::max(max_gap, (mesh_centroid - grid_centroid).norm());
+    }
+    float fallen = 0.6f - grid->position(0, 0).y();
+    float time = 200 * dt;
+    passed = passed && fallen > 0.45f * gravity * time * time && max_gap < 1e-4f * fallen;
+
+    // gravity cancelled
+    mesh.initialize();
+    mesh.external_force.fill(Vector3<float>(0.f, static_cast<float>(gravity), 0.f));
+    for (int step = 0; step < 200; ++step)
+        substep(mesh, far_balls, dt);
+    float drift = 0;
+    for (int v = 0; v < mesh.vertex_count(); ++v)
+        drift = std::max(drift, (mesh.position(v) - mesh.rest_position(v)).norm());
+    passed = passed && drift < 1e-4f;
+
+    // dropped on the balls for a second with adaptive substeps, the springs must not blow up on contact
+    mesh.initialize();
+    mesh.external_force.fill(Vector3<float>::Zero());
+    Philox random(1, 1);
+    Balls<ball_number> balls(ball_radius);
+    balls.initialize(random);
+    Adaptive_timestep<float> timestep(mesh.min_edge_length, 4e-2f / n, mesh.stable_dt());
+    int substeps = 0;
+    for (int frame = 0; frame < 60; ++frame)
+        substeps += advance(1.0f / 60, timestep, [&](const float dt) { return substep(mesh, balls, dt); });
+    bool finite = true;
+    float lowest = 1;
+    float max_strain = 0;
+    for (int v = 0; v < mesh.vertex_count(); ++v)
+    {
+        finite = finite && mesh.position(v).allFinite();
+        lowest = std::min(lowest, mesh.position(v).y());
+        for (int s = mesh.spring_begin[v]; s != mesh.spring_begin[v + 1]; ++s)
+            max_strain = std::max(max_strain, std::abs((mesh.position(v) - mesh.position(mesh.spring_neighbour[s])).norm() / mesh.spring_length[s] - 1));
+    }
+    passed = passed && finite && lowest < 0.f && max_strain < 0.2f;
+
+    std::cout << "mesh grid " << n << "x" << n << " springs " << mesh.spring_count() / 2 << " stable_dt " << mesh.stable_dt() << " free_fall " << fallen
+        << " centroid_gap " << max_gap << " held_drift " << drift << " drop_substeps " << substeps << " max_strain " << max_strain
+        << " lowest " << lowest << (finite ? "" : " not_finite") << std::endl;
+    return report("mesh", passed);
+}
+
+#ifdef CLOTH_HEADLESS_EGL
+// the cloth drawn as main.cpp does with lod, once with every tile and once with the tiles
+// cull_cloth keeps, for a camera that sees part of the cloth. Counts the triangles that reach
+// the rasterizer with a GL_PRIMITIVES_GENERATED query and compares the two images
+static bool check_culling()
+{
+    constexpr int n = 128;
+    constexpr int width = 256, height = 256;
+    Egl_context egl;
+    if (!egl.is_valid() || !gladLoadGLLoader((GLADloadproc)Egl_context::get_proc_address))
+        return report("culling", false);
+
+    auto cloth = std::make_unique<Cloth<n, n>>(1.0f / n);
+    Balls<ball_number> balls(ball_radius);
+    Philox random(1, 0);
+    cloth->initialize(random);
+    balls.initialize(random);
+    Adaptive_timestep<float> timestep(cloth->quad_size, 4e-2f / n);
+    for (int frame = 0; frame < 30; ++frame)
+        advance(*cloth, balls, 1.0f / 60, timestep);
+
+    const glm::vec3 eye(0.4f, 0.25f, 0.5f);
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), static_cast<float>(width) / height, 0.1f, 100.0f);
+    glm::mat4 view = glm::lookAt(eye, glm::vec3(0.4f, 0.f, 0.3f), glm::vec3(0.f, 1.f, 0.f));
+    Cloth_mesh<n, n> mesh;
+    Cloth_lod<n, n> lod;
+    lod.select(*cloth, eye, glm::radians(45.0f), height);
+    lod.pack_vertices(*cloth, mesh);
+
+    Multi_draw every_tile, visible_tiles;
+    for (auto& draw : lod.draws)
+    {
+        every_tile.counts.push_back(draw.count);
+        every_tile.offsets.push_back(reinterpret_cast<const void*>(static_cast<uintptr_t>(sizeof(unsigned int) * draw.first)));
+        every_tile.base_vertices.push_back(draw.base_vertex);
+    }
+    cull_cloth(Frustum(projection * view), mesh, lod, visible_tiles);
+
+    unsigned int framebuffer, renderbuffers[2];
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+    bool passed = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glViewport(0, 0, width, height);
+    glEnable(GL_DEPTH_TEST);
+
+    Shader cloth_shader("./cloth_simulation_demo/shader/cloth_vertex_shader.txt", "./cloth_simulation_demo/shader/cloth_fragment_shader.txt");
+    cloth_shader.use();
+    cloth_shader.set_matrix4f("model", glm::mat4(1.0f));
+    cloth_shader.set_matrix4f("view", view);
+    cloth_shader.set_matrix4f("projection", projection);
+    cloth_shader.set_float3("lightColor", 1.0f, 1.0f, 1.0f);
+    cloth_shader.set_float3("lightPos", 0.0f, 1.0f, 2.0f);
+    cloth_shader.set_float3("viewPos", eye.x, eye.y, eye.z);
+
+    unsigned int VBO, VAO, EBO, query;
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+    glGenBuffers(1, &EBO);
+    glGenQueries(1, &query);
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 9 * n * n, mesh.vertices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * lod.indices.size(), lod.indices.data(), GL_STATIC_DRAW);
+    for (unsigned int attribute = 0; attribute < 3; ++attribute)
+    {
+        glVertexAttribPointer(attribute, 3, GL_FLOAT, GL_FALSE, 9 * sizeof(float), (void*)(3 * attribute * sizeof(float)));
+        glEnableVertexAttribArray(attribute);
+    }
+
+    auto draw = [&](const Multi_draw& tiles, std::vector<unsigned char>& pixels)
+    {
+        glClearColor(0.f, 0.f, 0.f, 1.f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glBeginQuery(GL_PRIMITIVES_GENERATED, query);
+        glMultiDrawElementsBaseVertex(GL_TRIANGLES, tiles.counts.data(), GL_UNSIGNED_INT, tiles.offsets.data(), tiles.size(), tiles.base_vertices.data());
+        glEndQuery(GL_PRIMITIVES_GENERATED);
+        GLuint triangles = 0;
+        glGetQueryObjectuiv(query, GL_QUERY_RESULT, &triangles);
+        pixels.resize(4 * width * height);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+        return static_cast<long long>(triangles);
+    };
+
+    std::vector<unsigned char> every_tile_pixels, visible_tile_pixels;
+    long long every_tile_triangles = draw(every_tile, every_tile_pixels);
+    long long visible_tile_triangles = draw(visible_tiles, visible_tile_pixels);
+    long long expected_every = 0, expected_visible = 0, covered = 0;
+    for (GLsizei k = 0; k < every_tile.size(); ++k)
+        expected_every += every_tile.counts[k] / 3;
+    for (GLsizei k = 0; k < visible_tiles.size(); ++k)
+        expected_visible += visible_tiles.counts[k] / 3;
+    for (int k = 0; k < width * height; ++k)
+        covered += every_tile_pixels[4 * k] || every_tile_pixels[4 * k + 1] || every_tile_pixels[4 * k + 2];
+
+    passed = passed && glGetError() == GL_NO_ERROR && every_tile_triangles == expected_every && visible_tile_triangles == expected_visible
+        && visible_tile_triangles < every_tile_triangles && covered > 0 && every_tile_pixels == visible_tile_pixels;
+    std::cout << "culling grid " << n << "x" << n << " tiles " << every_tile.size() << " visible " << visible_tiles.size()
+        << " triangles " << every_tile_triangles << " culled " << visible_tile_triangles << " covered_pixels " << covered
+        << (every_tile_pixels == visible_tile_pixels ? " same_image" : " different_image") << std::endl;
+
+    glDeleteQueries(1, &query);
+    glDeleteBuffers(1, &EBO);
+    glDeleteBuffers(1, &VBO);
+    glDeleteVertexArrays(1, &VAO);
+    glDeleteRenderbuffers(2, renderbuffers);
+    glDeleteFramebuffers(1, &framebuffer);
+    return report("culling", passed);
+}
+#endif
+
+struct Check
+{
+    const char* name;
+    bool (*run)();
+};
+
+int main(int argc, char* argv[])
+{
+    const Check checks[] = {
+        { "sleep", check_sleep },
+        { "record", check_record },
+        { "mesh", check_mesh },
+#ifdef CLOTH_HEADLESS_EGL
+        { "culling", check_culling },
+#endif
+    };
+
+    bool passed = true;
+    for (const Check& check : checks)
+    {
+        bool selected = argc < 2;
+        for (int a = 1; a < argc; ++a)
+            selected = selected || !std::strcmp(argv[a], check.name);
+        if (selected)
+            passed = check.run() && passed;
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,378 @@
+#pragma once
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+
+// Minimal png writer: 8 bit rgb, no filtering, zlib stream of stored deflate blocks. Compressing
+// a 1024 x 1024 frame takes longer than a frame lasts, so files are left uncompressed and are
+// meant to be encoded to video afterwards.
+namespace png_codec
+{
+	// slicing by 8, the byte at a time loop is the slowest part of writing a frame
+	inline uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+	{
+		static const std::vector<uint32_t> table = []
+		{
+			std::vector<uint32_t> table(8 * 256);
+			for (uint32_t n = 0; n < 256; ++n)
+			{
+				uint32_t c = n;
+				for (int k = 0; k < 8; ++k)
+					c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+				table[n] = c;
+			}
+			for (uint32_t n = 0; n < 256; ++n)
+			{
+				for (int slice = 1; slice < 8; ++slice)
+					table[slice * 256 + n] = table[(slice - 1) * 256 + n] >> 8 ^ table[table[(slice - 1) * 256 + n] & 0xff];
+			}
+			return table;
+		}();
+
+		crc = ~crc;
+		for (; size >= 8; size -= 8, data += 8)
+		{
+			uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | static_cast<uint32_t>(data[3]) << 24);
+			crc = table[7 * 256 + (low & 0xff)] ^ table[6 * 256 + (low >> 8 & 0xff)] ^ table[5 * 256 + (low >> 16 & 0xff)] ^ table[4 * 256 + (low >> 24)]
+				^ table[3 * 256 + data[4]] ^ table[2 * 256 + data[5]] ^ table[256 + data[6]] ^ table[data[7]];
+		}
+		for (; size > 0; --size, ++data)
+			crc = table[(crc ^ *data) & 0xff] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	inline uint32_t adler32(const uint8_t* data, size_t size, uint32_t adler = 1)
+	{
+		uint32_t a = adler & 0xffff, b = adler >> 16;
+		while (size > 0)
+		{
+			// the sums can't overflow 32 bits within 5552 bytes
+			size_t block = std::min<size_t>(size, 5552);
+			for (size_t k = 0; k < block; ++k)
+			{
+				a += data[k];
+				b += a;
+			}
+			a %= 65521;
+			b %= 65521;
+			data += block;
+			size -= block;
+		}
+		return (b << 16) | a;
+	}
+
+	inline void put_u32(std::vector<uint8_t>& out, uint32_t value)
+	{
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back(static_cast<uint8_t>(value >> shift));
+	}
+
+	inline void put_chunk(std::vector<uint8_t>& out, const char type[4], const uint8_t* data, size_t size)
+	{
+		put_u32(out, static_cast<uint32_t>(size));
+		size_t start = out.size();
+		out.insert(out.end(), type, type + 4);
+		out.insert(out.end(), data, data + size);
+		put_u32(out, crc32(out.data() + start, out.size() - start));
+	}
+
+	// rows holds height rows of 3 * width bytes, each led by its filter byte
+	inline void encode(const std::vector<uint8_t>& rows, int width, int height, std::vector<uint8_t>& out)
+	{
+		static constexpr uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		out.clear();
+		out.insert(out.end(), signature, signature + 8);
+
+		std::vector<uint8_t> header;
+		put_u32(header, static_cast<uint32_t>(width));
+		put_u32(header, static_cast<uint32_t>(height));
+		header.insert(header.end(), { 8, 2, 0, 0, 0 }); // bit depth, rgb, deflate, adaptive filtering, no interlace
+		put_chunk(out, "IHDR", header.data(), header.size());
+
+		// the IDAT chunk is built in place to copy the pixels only once
+		size_t blocks = std::max<size_t>((rows.size() + 65534) / 65535, 1);
+		size_t zlib_size = 2 + 5 * blocks + rows.size() + 4;
+		out.reserve(out.size() + 12 + zlib_size + 12);
+		put_u32(out, static_cast<uint32_t>(zlib_size));
+		size_t start = out.size();
+		out.insert(out.end(), { 'I', 'D', 'A', 'T', 0x78, 0x01 });
+		for (size_t block = 0; block < blocks; ++block)
+		{
+			size_t offset = block * 65535;
+			size_t size = std::min<size_t>(rows.size() - offset, 65535);
+			out.push_back(block + 1 == blocks ? 1 : 0);
+			out.push_back(static_cast<uint8_t>(size));
+			out.push_back(static_cast<uint8_t>(size >> 8));
+			out.push_back(static_cast<uint8_t>(~size));
+			out.push_back(static_cast<uint8_t>(~size >> 8));
+			out.insert(out.end(), rows.begin() + offset, rows.begin() + offset + size);
+		}
+		put_u32(out, adler32(rows.data(), rows.size()));
+		put_u32(out, crc32(out.data() + start, out.size() - start));
+		put_chunk(out, "IEND", nullptr, 0);
+	}
+}
+
+// Renders into an offscreen framebuffer and writes every frame as a png. Readback goes through
+// two pixel pack buffers: capture() starts an asynchronous glReadPixels of the frame just rendered
+// into one of them and maps the other one, whose readback was issued a frame earlier and has had
+// the rendering of a whole frame to complete. Converting and writing the png happen on a separate
+// task arena of two writers, so the render loop only pays for one copy of the mapped pixels.
+class Frame_capture
+{
+public:
+	// path_pattern is a printf format taking the frame number, e.g. "frame_%05d.png"
+	Frame_capture(int width, int height, const std::string& path_pattern, int max_frames_in_flight = 8);
+	~Frame_capture();
+
+	bool is_complete() const;
+	void bind() const; // the offscreen framebuffer becomes the render target
+	void capture(); // call after the frame has been rendered into the framebuffer
+	void finish(); // writes the last frame and waits for all pngs to be written
+
+	int frames_captured() const;
+	double stall_seconds() const; // time capture() waited for readback or for the writers
+
+private:
+	struct Frame
+	{
+		int number;
+		std::shared_ptr<std::vector<uint8_t>> pixels; // rgba, bottom row first, as read back
+	};
+
+	void start_readback(int buffer);
+	void retire(int buffer, int number);
+	void write(const Frame& frame);
+
+private:
+	int width, height;
+	std::string path_pattern;
+	int max_frames_in_flight;
+
+	GLuint framebuffer, color_buffer, depth_buffer;
+	GLuint pixel_buffers[2];
+	GLsync fences[2];
+	int pending_frame[2]; // frame read back into each pixel buffer, -1 if none
+	int next_buffer;
+	int frame_number;
+	double stall;
+
+	tbb::task_arena arena; // both slots go to writers, none is reserved for the render thread
+	tbb::task_group group;
+	std::mutex mutex;
+	int frames_in_flight;
+	std::vector<std::shared_ptr<std::vector<uint8_t>>> free_pixels;
+};
+
+inline Frame_capture::Frame_capture(int width, int height, const std::string& path_pattern, int max_frames_in_flight) :
+	width(width), height(height), path_pattern(path_pattern), max_frames_in_flight(max_frames_in_flight),
+	fences{ nullptr, nullptr }, pending_frame{ -1, -1 }, next_buffer(0), frame_number(0), stall(0), arena(2, 0), frames_in_flight(0)
+{
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glGenRenderbuffers(1, &color_buffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, color_buffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_buffer);
+	glGenRenderbuffers(1, &depth_buffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth_buffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depth_buffer);
+	if (!is_complete())
+		std::cout << "ERROR::CAPTURE::FRAMEBUFFER_INCOMPLETE: " << glCheckFramebufferStatus(GL_FRAMEBUFFER) << std::endl;
+
+	std::vector<char> first_path(path_pattern.size() + 32);
+	std::snprintf(first_path.data(), first_path.size(), path_pattern.c_str(), 0);
+	std::filesystem::path directory = std::filesystem::path(first_path.data()).parent_path();
+	std::error_code error;
+	if (!directory.empty())
+		std::filesystem::create_directories(directory, error);
+
+	glGenBuffers(2, pixel_buffers);
+	for (GLuint pixel_buffer : pixel_buffers)
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffer);
+		glBufferData(GL_PIXEL_PACK_BUFFER, static_cast<GLsizeiptr>(4) * width * height, nullptr, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+inline Frame_capture::~Frame_capture()
+{
+	arena.execute([&] { group.wait(); });
+	for (GLsync fence : fences)
+	{
+		if (fence)
+			glDeleteSync(fence);
+	}
+	glDeleteBuffers(2, pixel_buffers);
+	glDeleteRenderbuffers(1, &color_buffer);
+	glDeleteRenderbuffers(1, &depth_buffer);
+	glDeleteFramebuffers(1, &framebuffer);
+}
+
+inline bool Frame_capture::is_complete() const
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+inline void Frame_capture::bind() const
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(0, 0, width, height);
+}
+
+inline int Frame_capture::frames_captured() const
+{
+	return frame_number;
+}
+
+inline double Frame_capture::stall_seconds() const
+{
+	return stall;
+}
+
+inline void Frame_capture::start_readback(int buffer)
+{
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffers[buffer]);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	// with a pack buffer bound the last argument is an offset and the call returns at once
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	fences[buffer] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+inline void Frame_capture::retire(int buffer, int number)
+{
+	auto start = std::chrono::steady_clock::now();
+	glClientWaitSync(fences[buffer], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+	glDeleteSync(fences[buffer]);
+	fences[buffer] = nullptr;
+
+	bool writers_behind;
+	std::shared_ptr<std::vector<uint8_t>> pixels;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		writers_behind = frames_in_flight >= max_frames_in_flight;
+		++frames_in_flight;
+		if (!free_pixels.empty())
+		{
+			pixels = free_pixels.back();
+			free_pixels.pop_back();
+		}
+	}
+	if (writers_behind)
+	{
+		// bound the memory of queued frames, and keep writing when tbb has no spare worker
+		arena.execute([&] { group.wait(); });
+	}
+	stall += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (!pixels)
+		pixels = std::make_shared<std::vector<uint8_t>>();
+	pixels->resize(static_cast<size_t>(4) * width * height);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_buffers[buffer]);
+	const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, pixels->size(), GL_MAP_READ_BIT);
+	if (mapped)
+	{
+		std::copy(static_cast<const uint8_t*>(mapped), static_cast<const uint8_t*>(mapped) + pixels->size(), pixels->data());
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	else
+	{
+		std::cout << "ERROR::CAPTURE::MAP_FAILED: frame " << number << std::endl;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	Frame frame{ number, pixels };
+	arena.execute([&] { group.run([this, frame] { write(frame); }); });
+}
+
+inline void Frame_capture::write(const Frame& frame)
+{
+	// flip to top row first and drop alpha, every row led by filter type 0
+	std::vector<uint8_t> rows(static_cast<size_t>(3 * width + 1) * height);
+	for (int y = 0; y < height; ++y)
+	{
+		const uint8_t* source = frame.pixels->data() + static_cast<size_t>(4) * width * (height - 1 - y);
+		uint8_t* row = rows.data() + static_cast<size_t>(3 * width + 1) * y;
+		*row++ = 0;
+		for (int x = 0; x < width; ++x, source += 4, row += 3)
+		{
+			row[0] = source[0];
+			row[1] = source[1];
+			row[2] = source[2];
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		free_pixels.push_back(frame.pixels);
+	}
+
+	std::vector<uint8_t> png;
+	png_codec::encode(rows, width, height, png);
+
+	std::vector<char> path(path_pattern.size() + 32);
+	std::snprintf(path.data(), path.size(), path_pattern.c_str(), frame.number);
+	std::FILE* file = std::fopen(path.data(), "wb");
+	if (file)
+	{
+		std::fwrite(png.data(), 1, png.size(), file);
+		std::fclose(file);
+	}
+	else
+	{
+		std::cout << "ERROR::CAPTURE::FILE_NOT_OPENED: " << path.data() << std::endl;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	--frames_in_flight;
+}
+
+inline void Frame_capture::capture()
+{
+	int buffer = next_buffer;
+	next_buffer = 1 - next_buffer;
+
+	start_readback(buffer);
+	// the other buffer holds the previous frame
+	if (pending_frame[next_buffer] >= 0)
+	{
+		retire(next_buffer, pending_frame[next_buffer]);
+		pending_frame[next_buffer] = -1;
+	}
+	pending_frame[buffer] = frame_number++;
+}
+
+inline void Frame_capture::finish()
+{
+	for (int k = 0; k < 2; ++k)
+	{
+		int buffer = (next_buffer + k) % 2;
+		if (pending_frame[buffer] >= 0)
+		{
+			retire(buffer, pending_frame[buffer]);
+			pending_frame[buffer] = -1;
+		}
+	}
+	arena.execute([&] { group.wait(); });
+}
+
+#endif
@@ -9,8 +9,16 @@
 #include <vector>
 #include <cmath>
 #include <utility>
-#include <Eigen/dense>
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
 #include <tbb/blocked_range2d.h>
 
 using namespace Eigen;
@@ -20,18 +28,24 @@ static constexpr int dashpot_damping = 1e4;
 static constexpr int drag_damping = 1;
 static constexpr float fraction = 0.99f;
 static constexpr float pi = 3.141592653589793f;
+static constexpr double gravity = 9.8;
 
 std::random_device rd;
 std::mt19937 generator(rd());
 std::uniform_real_distribution<float> dis(0., 1.0);
 
 std::vector<std::pair<int, int>> spring_offset{ {-2,0},{-1,-1},{-1,0},{-1,1},{0,-2},{0,-1},{0,1},{0,2},{1,-1},{1,0},{1,1},{2,0} };
+static constexpr std::uint16_t all_springs = (1 << 12) - 1; // one bit per spring_offset, see Cloth::springs
+static constexpr int spring_class[] = { 2, 1, 0, 1, 2, 0, 0, 2, 1, 0, 1, 2 }; // per spring_offset: 0 structural, 1 shear, 2 bending
 
+// Eigen 3.4 has these aliases itself, declaring them again makes Vector3<T> ambiguous
+#if !EIGEN_VERSION_AT_LEAST(3, 4, 0)
 template<typename T>
 using Vector3 = Matrix<T, 3, 1>;
 
 template<typename T>
 using Vector2 = Matrix<T, 2, 1>;
+#endif
 
 template<int M, int N, typename T = float>
 class Cloth
@@ -40,12 +54,17 @@ public:
 	Cloth(const T& quad_size);
 	~Cloth();
 
-	void initialize();
+	void initialize(); // random offsets from the global generator
+	template<typename Generator>
+	void initialize(Generator& random);
 
 public:
 	Array<Vector3<T>, Dynamic, Dynamic> position;
 	Array<Vector3<T>, Dynamic, Dynamic> velocity;
+	Array<Vector3<T>, Dynamic, Dynamic> external_force; // added to gravity in every substep, e.g. wind (see wind.h)
+	Array<std::uint16_t, Dynamic, Dynamic> springs; // bit k is set while the spring to spring_offset[k] is intact
 	T quad_size;
+	T tear_strain; // springs stretched beyond (1 + tear_strain) times their rest length break, never by default
 };
 
 
@@ -56,7 +75,9 @@ public:
 	Balls(const T& radius);
 	~Balls();
 
-	void initialize();
+	void initialize(); // random centers from the global generator
+	template<typename Generator>
+	void initialize(Generator& random);
 
 public:
 	Array<Vector3<T>, Number, 1> center;
@@ -64,6 +85,146 @@ public:
 	T radius;
 };
 
+// maxima gathered by substep, used to choose the next time step
+template<typename T = float>
+struct Substep_stats
+{
+	T max_speed = 0;
+	T max_strain_rate = 0; // |d(current_dist / original_dist)/dt| over all springs
+
+	Substep_stats& merge(const Substep_stats& another);
+};
+
+// Substep_stats plus measures of the state of the cloth, to check that a change to the solver
+// keeps the physics. Energies are per unit particle mass like the forces of the solver, the
+// spring energy and strains are taken in the velocity pass, the kinetic and gravity energy
+// after the position pass. Strain is |current / original length - 1|, penetration is the
+// depth of a particle inside a ball it collides with.
+template<typename T = float>
+struct Substep_diagnostics : Substep_stats<T>
+{
+	static constexpr int spring_classes = 3;
+
+	double kinetic_energy = 0;
+	double spring_energy = 0;
+	double gravity_energy = 0;
+	T max_strain[spring_classes] = {};
+	double strain_sum[spring_classes] = {};
+	std::int64_t spring_ends[spring_classes] = {}; // intact springs are seen from both ends
+	T max_penetration = 0;
+	std::int64_t contacts = 0; // particle and ball pairs
+
+	double total_energy() const;
+	double mean_strain(int spring_class) const;
+	Substep_diagnostics& merge(const Substep_diagnostics& another);
+};
+
+// picks dt for the next substep from the stats of the last one. dt never exceeds dt_max,
+// which is kept below the explicit stability limit of the springs, so it is fast motion
+// (a particle crossing too much of a quad, or springs stretching too fast) that pulls it down.
+template<typename T = float>
+class Adaptive_timestep
+{
+public:
+	Adaptive_timestep(const T& quad_size, const T& initial_dt);
+	// dt_max from stable_dt instead of explicit_stable_dt(quad_size), for springs other than spring_offset
+	Adaptive_timestep(const T& quad_size, const T& initial_dt, const T& stable_dt);
+
+	T next(const Substep_stats<T>& stats);
+
+public:
+	T dt;
+	T dt_min;
+	T dt_max;
+	T cfl; // fraction of a quad a particle may travel in one substep
+	T max_strain_step; // strain change a spring may undergo in one substep
+	T growth; // largest increase of dt from one substep to the next
+};
+
+template<typename T = float>
+T explicit_stable_dt(const T& quad_size);
+
+// largest dt symplectic euler stays stable at for a mode of frequency^2 omega_squared damped at gamma
+template<typename T = float>
+T damped_stable_dt(const T& omega_squared, const T& gamma);
+
+// rectangular tiles of Size x Size particles covering an M x N grid, numbered row by row.
+// tiles in the last row and column are smaller when Size does not divide M or N.
+template<int M, int N, int Size>
+struct Tile_grid
+{
+	static constexpr int size = Size;
+	static constexpr int rows = (M + Size - 1) / Size;
+	static constexpr int cols = (N + Size - 1) / Size;
+	static constexpr int count = rows * cols;
+
+	static constexpr int row_begin(int tile) { return (tile / cols) * Size; }
+	static constexpr int row_end(int tile) { return std::min(row_begin(tile) + Size, M); }
+	static constexpr int col_begin(int tile) { return (tile % cols) * Size; }
+	static constexpr int col_end(int tile) { return std::min(col_begin(tile) + Size, N); }
+};
+
+// index of the lowest set bit, word must not be 0
+inline int lowest_bit(uint64_t word)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, word);
+	return static_cast<int>(index);
+#else
+	return __builtin_ctzll(word);
+#endif
+}
+
+// tile level sleep state for substep. A tile whose particles stayed slower than sleep_speed and
+// whose velocity changed slower than sleep_residual for sleep_steps substeps is put asleep: its
+// velocities are zeroed and substep skips it. A sleeping tile wakes when one of its 8 neighbours
+// is awake and still moving, or when wake_all / wake_touching is called for moved colliders.
+template<int M, int N, typename T = float>
+class Cloth_sleep
+{
+public:
+	using Tiles = Tile_grid<M, N, 16>;
+
+	Cloth_sleep();
+	~Cloth_sleep();
+
+	bool is_awake(int tile) const;
+	int awake_count() const;
+	void wake(int tile);
+	void wake_all();
+	template<int Number>
+	void wake_touching(const Balls<Number, T>& balls);
+
+	const std::vector<int>& collect_awake_tiles();
+	void update(Cloth<M, N, T>& cloth);
+
+public:
+	T sleep_speed;
+	T sleep_residual;
+	int sleep_steps;
+
+	// written by substep for every awake tile
+	std::vector<T> tile_speed;
+	std::vector<T> tile_residual;
+	Array<Vector3<T>, Dynamic, Dynamic> start_velocity;
+
+private:
+	void put_to_sleep(Cloth<M, N, T>& cloth, int tile);
+
+private:
+	std::vector<uint64_t> awake; // one bit per tile
+	std::vector<uint64_t> next_awake;
+	std::vector<int> quiet_steps;
+	std::vector<int> active_tiles;
+	std::vector<Vector3<T>> sleep_min; // bounding box of a tile when it fell asleep
+	std::vector<Vector3<T>> sleep_max;
+};
+
+// tiles of quads used to draw the cloth mesh piecewise (level of detail and culling)
+template<int M, int N>
+using Mesh_tiles = Tile_grid<M - 1, N - 1, 32>;
+
 template<int M, int N, typename T = float>
 class Cloth_mesh
 {
@@ -71,18 +232,28 @@ public:
 	Cloth_mesh();
 	~Cloth_mesh();
 
-	void update_vertices(const Cloth<M, N, T>& cloth);
-
-private:
-	void update_triangles_normalvec(const Cloth<M, N, T>& cloth);
+	void update_vertices(const Cloth<M, N, T>& cloth); // also updates tile_min and tile_max
+	void update_triangles_normalvec(const Cloth<M, N, T>& cloth); // part of update_vertices
+	// the same for one of Mesh_tiles<M, N>: normals of its triangles, and the vertices it packs
+	// with its bounding box, which needs the normals of the neighbouring tiles too
+	void update_tile_normals(const Cloth<M, N, T>& cloth, int tile);
+	void update_tile_vertices(const Cloth<M, N, T>& cloth, int tile);
+	// turns the triangles with a broken spring along an edge into degenerate ones, returns whether any index changed
+	bool update_indices(const Cloth<M, N, T>& cloth);
 
 public:
 	unsigned int* indices;
 	T* vertices;
-
-private:
+	std::vector<Vector3<T>> tile_min; // bounding box of each of Mesh_tiles<M, N>
+	std::vector<Vector3<T>> tile_max;
+	std::vector<std::pair<int, int>> changed_indices; // runs of (first index, count) changed by the last update_indices
+	// unit normals of the triangles (i, j), (i + 1, j), (i, j + 1) and (i + 1, j + 1), (i, j + 1), (i + 1, j) of quad (i, j)
 	Array<Vector3<T>, Dynamic, Dynamic> bottom_left; //normal vector for triangle mesh
 	Array<Vector3<T>, Dynamic, Dynamic> up_right; //normal vector for triangle mesh
+
+private:
+	Array<std::uint16_t, Dynamic, Dynamic> drawn_springs; // the springs of the cloth at the last update_indices
+	std::vector<std::vector<std::pair<int, int>>> row_changes; // changed_indices of each row of quads
 };
 
 template<int Number, int X_SEGMENTS = 30, int Y_SEGMENTS = 30, typename T = float>
@@ -100,9 +271,12 @@ public:
 };
 
 template<int M, int N, typename T>
-inline Cloth<M, N, T>::Cloth(const T& quad_size) : position(M, N), velocity(M, N)
+inline Cloth<M, N, T>::Cloth(const T& quad_size) : position(M, N), velocity(M, N), external_force(M, N), springs(M, N)
 {
 	this->quad_size = quad_size;
+	this->tear_strain = std::numeric_limits<T>::infinity();
+	external_force.fill(Vector3<T>::Zero());
+	springs.fill(all_springs);
 }
 
 template<int M, int N, typename T>
@@ -113,8 +287,16 @@ inline Cloth<M, N, T>::~Cloth()
 template<int M, int N, typename T>
 inline void Cloth<M, N, T>::initialize()
 {
-	T random_offset_x = 0.1 * (dis(generator) - 0.5);
-	T random_offset_z = 0.1 * (dis(generator) - 0.5);
+	initialize(generator);
+}
+
+template<int M, int N, typename T>
+template<typename Generator>
+inline void Cloth<M, N, T>::initialize(Generator& random)
+{
+	std::uniform_real_distribution<float> uniform(0., 1.0);
+	T random_offset_x = 0.1 * (uniform(random) - 0.5);
+	T random_offset_z = 0.1 * (uniform(random) - 0.5);
 
 	tbb::parallel_for(tbb::blocked_range<int>(0, N), [&](const tbb::blocked_range<int>& r)
 		{
@@ -126,6 +308,7 @@ inline void Cloth<M, N, T>::initialize()
 					position.coeffRef(i, j).coeffRef(1) = 0.6;
 					position.coeffRef(i, j).coeffRef(2) = j * quad_size - 0.5 + random_offset_z;
 					velocity(i, j) = Vector3<T>::Zero();
+					springs(i, j) = all_springs;
 				}
 			}
 		}
@@ -148,88 +331,544 @@ inline Balls<Number, T>::~Balls()
 template<int Number, typename T>
 inline void Balls<Number, T>::initialize()
 {
+	initialize(generator);
+}
+
+// the balls are drawn one after another, so the centers only depend on the state of random
+template<int Number, typename T>
+template<typename Generator>
+inline void Balls<Number, T>::initialize(Generator& random)
+{
+	std::uniform_real_distribution<float> uniform(0., 1.0);
 	quad_size_ball = 1.0 / Number;
-	tbb::parallel_for(tbb::blocked_range<int>(0, Number), [&](const tbb::blocked_range<int>& r)
+	for (int i = 0; i < Number; ++i)
+	{
+		center.coeffRef(i).coeffRef(0) = (i * quad_size_ball - 0.4 + (uniform(random) - 0.5) / 15) * 0.9;
+		center.coeffRef(i).coeffRef(1) = ((uniform(random) - 0.5) / 3 - 0.1) * 0.9;
+		center.coeffRef(i).coeffRef(2) = (i * quad_size_ball - 0.4 + (uniform(random) - 0.5) / 15) * 0.9;
+	}
+}
+
+
+template<typename T>
+inline Substep_stats<T>& Substep_stats<T>::merge(const Substep_stats<T>& another)
+{
+	max_speed = std::max(max_speed, another.max_speed);
+	max_strain_rate = std::max(max_strain_rate, another.max_strain_rate);
+	return *this;
+}
+
+template<typename T>
+inline double Substep_diagnostics<T>::total_energy() const
+{
+	return kinetic_energy + spring_energy + gravity_energy;
+}
+
+template<typename T>
+inline double Substep_diagnostics<T>::mean_strain(int spring_class) const
+{
+	return spring_ends[spring_class] ? strain_sum[spring_class] / spring_ends[spring_class] : 0;
+}
+
+template<typename T>
+inline Substep_diagnostics<T>& Substep_diagnostics<T>::merge(const Substep_diagnostics<T>& another)
+{
+	Substep_stats<T>::merge(another);
+	kinetic_energy += another.kinetic_energy;
+	spring_energy += another.spring_energy;
+	gravity_energy += another.gravity_energy;
+	for (int c = 0; c < spring_classes; ++c)
+	{
+		max_strain[c] = std::max(max_strain[c], another.max_strain[c]);
+		strain_sum[c] += another.strain_sum[c];
+		spring_ends[c] += another.spring_ends[c];
+	}
+	max_penetration = std::max(max_penetration, another.max_penetration);
+	contacts += another.contacts;
+	return *this;
+}
+
+template<typename T>
+inline T explicit_stable_dt(const T& quad_size)
+{
+	// the stiffest mode of the spring stencil has omega^2 ~ 8 * spring_Y / quad_size and the
+	// dashpots damp it at gamma ~ 8 * dashpot_damping * quad_size; symplectic euler needs
+	// (dt * omega)^2 + 2 * dt * gamma < 4, where gamma dominates on coarse grids
+	return damped_stable_dt<T>(8 * spring_Y / quad_size, 8 * dashpot_damping * quad_size);
+}
+
+template<typename T>
+inline T damped_stable_dt(const T& omega_squared, const T& gamma)
+{
+	return (std::sqrt(gamma * gamma + 4 * omega_squared) - gamma) / omega_squared;
+}
+
+template<typename T>
+inline Adaptive_timestep<T>::Adaptive_timestep(const T& quad_size, const T& initial_dt) : Adaptive_timestep(quad_size, initial_dt, explicit_stable_dt(quad_size))
+{
+}
+
+template<typename T>
+inline Adaptive_timestep<T>::Adaptive_timestep(const T& quad_size, const T& initial_dt, const T& stable_dt)
+{
+	dt_max = static_cast<T>(0.8) * stable_dt;
+	dt = std::min(initial_dt, dt_max);
+	dt_min = std::min(initial_dt, dt_max) / 8;
+	cfl = static_cast<T>(0.5) * quad_size;
+	max_strain_step = static_cast<T>(0.25);
+	growth = static_cast<T>(1.2);
+}
+
+template<typename T>
+inline T Adaptive_timestep<T>::next(const Substep_stats<T>& stats)
+{
+	T target = dt_max;
+	if (stats.max_speed > 0)
+		target = std::min(target, cfl / stats.max_speed);
+	if (stats.max_strain_rate > 0)
+		target = std::min(target, max_strain_step / stats.max_strain_rate);
+	dt = std::clamp(std::min(target, dt * growth), dt_min, dt_max);
+	return dt;
+}
+
+
+template<int M, int N, typename T>
+inline Cloth_sleep<M, N, T>::Cloth_sleep() : tile_speed(Tiles::count, 0), tile_residual(Tiles::count, 0), start_velocity(M, N),
+	awake((Tiles::count + 63) / 64, 0), next_awake((Tiles::count + 63) / 64, 0), quiet_steps(Tiles::count, 0), sleep_min(Tiles::count), sleep_max(Tiles::count)
+{
+	sleep_speed = static_cast<T>(0.05);
+	sleep_residual = static_cast<T>(2.0);
+	sleep_steps = 200;
+	active_tiles.reserve(Tiles::count);
+	wake_all();
+}
+
+template<int M, int N, typename T>
+inline Cloth_sleep<M, N, T>::~Cloth_sleep()
+{
+}
+
+template<int M, int N, typename T>
+inline bool Cloth_sleep<M, N, T>::is_awake(int tile) const
+{
+	return (awake[tile / 64] >> (tile % 64)) & 1;
+}
+
+template<int M, int N, typename T>
+inline int Cloth_sleep<M, N, T>::awake_count() const
+{
+	int count = 0;
+	for (int tile = 0; tile < Tiles::count; ++tile)
+		count += is_awake(tile);
+	return count;
+}
+
+template<int M, int N, typename T>
+inline void Cloth_sleep<M, N, T>::wake(int tile)
+{
+	if (!is_awake(tile))
+	{
+		awake[tile / 64] |= (uint64_t(1) << (tile % 64));
+		quiet_steps[tile] = 0;
+	}
+}
+
+template<int M, int N, typename T>
+inline void Cloth_sleep<M, N, T>::wake_all()
+{
+	std::fill(awake.begin(), awake.end(), 0);
+	for (int tile = 0; tile < Tiles::count; ++tile)
+		awake[tile / 64] |= (uint64_t(1) << (tile % 64));
+	std::fill(quiet_steps.begin(), quiet_steps.end(), 0);
+}
+
+template<int M, int N, typename T>
+template<int Number>
+inline void Cloth_sleep<M, N, T>::wake_touching(const Balls<Number, T>& balls)
+{
+	for (int tile = 0; tile < Tiles::count; ++tile)
+	{
+		if (is_awake(tile))
+			continue;
+		for (int k = 0; k < Number; ++k)
 		{
-			for (int i = r.begin(); i != r.end(); ++i)
+			Vector3<T> closest(balls.center.coeff(k).cwiseMax(sleep_min[tile]).cwiseMin(sleep_max[tile]));
+			if ((closest - balls.center.coeff(k)).norm() <= balls.radius)
 			{
-				center.coeffRef(i).coeffRef(0) = (i * quad_size_ball - 0.4 + (dis(generator) - 0.5) / 15) * 0.9;
-				center.coeffRef(i).coeffRef(1) = ((dis(generator) - 0.5) / 3 - 0.1) * 0.9;
-				center.coeffRef(i).coeffRef(2) = (i * quad_size_ball - 0.4 + (dis(generator) - 0.5) / 15) * 0.9;
+				wake(tile);
+				break;
 			}
 		}
-	);
+	}
+}
+
+template<int M, int N, typename T>
+inline const std::vector<int>& Cloth_sleep<M, N, T>::collect_awake_tiles()
+{
+	active_tiles.clear();
+	for (size_t w = 0; w < awake.size(); ++w)
+	{
+		for (uint64_t word = awake[w]; word != 0; word &= word - 1)
+			active_tiles.push_back(static_cast<int>(w * 64) + lowest_bit(word));
+	}
+	return active_tiles;
+}
+
+template<int M, int N, typename T>
+inline void Cloth_sleep<M, N, T>::update(Cloth<M, N, T>& cloth)
+{
+	auto is_moving = [this](int tile) { return tile_speed[tile] > sleep_speed || tile_residual[tile] > sleep_residual; };
+	next_awake = awake;
+	for (int tile : active_tiles)
+		quiet_steps[tile] = is_moving(tile) ? 0 : quiet_steps[tile] + 1;
+	for (int tile : active_tiles)
+	{
+		if (!is_moving(tile))
+			continue;
+
+		// a moving tile keeps its neighbours awake, and quiet ones along it from falling asleep
+		// only to be woken again by the next substep
+		int tile_i = tile / Tiles::cols;
+		int tile_j = tile % Tiles::cols;
+		for (int di = -1; di <= 1; ++di)
+		{
+			for (int dj = -1; dj <= 1; ++dj)
+			{
+				int i = tile_i + di;
+				int j = tile_j + dj;
+				if (i >= 0 && i < Tiles::rows && j >= 0 && j < Tiles::cols)
+				{
+					int another = i * Tiles::cols + j;
+					next_awake[another / 64] |= (uint64_t(1) << (another % 64));
+					quiet_steps[another] = 0;
+				}
+			}
+		}
+	}
+	awake.swap(next_awake);
+
+	for (int tile : active_tiles)
+	{
+		if (quiet_steps[tile] >= sleep_steps)
+			put_to_sleep(cloth, tile);
+	}
+}
+
+template<int M, int N, typename T>
+inline void Cloth_sleep<M, N, T>::put_to_sleep(Cloth<M, N, T>& cloth, int tile)
+{
+	awake[tile / 64] &= ~(uint64_t(1) << (tile % 64));
+	sleep_min[tile] = cloth.position.coeff(Tiles::row_begin(tile), Tiles::col_begin(tile));
+	sleep_max[tile] = sleep_min[tile];
+	for (int j = Tiles::col_begin(tile); j != Tiles::col_end(tile); ++j)
+	{
+		for (int i = Tiles::row_begin(tile); i != Tiles::row_end(tile); ++i)
+		{
+			cloth.velocity.coeffRef(i, j) = Vector3<T>::Zero();
+			sleep_min[tile] = sleep_min[tile].cwiseMin(cloth.position.coeff(i, j));
+			sleep_max[tile] = sleep_max[tile].cwiseMax(cloth.position.coeff(i, j));
+		}
+	}
+}
+
+// spring and dashpot force on a particle from a spring to another one, x_diff and v_diff
+// are its position and velocity relative to the other particle
+template<typename T>
+inline Vector3<T> spring_force(const Vector3<T>& x_diff, const Vector3<T>& v_diff, const T original_dist, const T damping_length, Substep_stats<T>& stats)
+{
+	T current_dist = x_diff.norm();
+	Vector3<T> d(x_diff / current_dist);
+	T normal_speed = v_diff.dot(d);
+	stats.max_strain_rate = std::max(stats.max_strain_rate, std::abs(normal_speed) / original_dist);
+
+	return -spring_Y * d * (current_dist / original_dist - 1) //spring force
+		- normal_speed * d * dashpot_damping * damping_length; //dashpot damping
+}
+
+// measures of Substep_diagnostics, plain Substep_stats take none of them
+template<typename T>
+inline void measure_spring(Substep_stats<T>&, const int, const T, const T)
+{
+}
+
+template<typename T>
+inline void measure_spring(Substep_diagnostics<T>& diagnostics, const int spring_class, const T squared_dist, const T original_dist)
+{
+	T strain = std::abs(std::sqrt(squared_dist) / original_dist - 1);
+	diagnostics.max_strain[spring_class] = std::max(diagnostics.max_strain[spring_class], strain);
+	diagnostics.strain_sum[spring_class] += strain;
+	++diagnostics.spring_ends[spring_class];
+	// spring_Y * original_dist * strain^2 / 2, shared by the two ends
+	diagnostics.spring_energy += 0.25 * spring_Y * original_dist * strain * strain;
+}
+
+template<typename T>
+inline void measure_contact(Substep_stats<T>&, const T)
+{
+}
+
+template<typename T>
+inline void measure_contact(Substep_diagnostics<T>& diagnostics, const T depth)
+{
+	diagnostics.max_penetration = std::max(diagnostics.max_penetration, depth);
+	++diagnostics.contacts;
+}
+
+template<typename T>
+inline void measure_particle(Substep_stats<T>&, const Vector3<T>&, const Vector3<T>&)
+{
+}
+
+template<typename T>
+inline void measure_particle(Substep_diagnostics<T>& diagnostics, const Vector3<T>& position, const Vector3<T>& velocity)
+{
+	diagnostics.kinetic_energy += 0.5 * velocity.squaredNorm();
+	diagnostics.gravity_energy += gravity * position.y();
+}
+
+// drag, collision with balls and position update of a particle
+template<int Number, typename T, typename Stats>
+inline void move_particle(Vector3<T>& position, Vector3<T>& velocity, const Balls<Number, T>& balls, const T dt, Stats& stats)
+{
+	velocity *= std::exp(-drag_damping * dt);
+	for (int k = 0; k < Number; ++k)  //handling collision with balls
+	{
+		Vector3<T> offset_to_center(position - balls.center.coeff(k));
+		if (offset_to_center.norm() <= balls.radius)
+		{
+			measure_contact(stats, balls.radius - offset_to_center.norm());
+			Vector3<T> normal(offset_to_center.normalized());
+			velocity -= (std::min(velocity.dot(normal), static_cast<T>(0)) * normal);
+			velocity *= fraction;
+		}
+	}
+
+	position += (velocity * dt);
+	stats.max_speed = std::max(stats.max_speed, velocity.norm());
+}
+
+// spring, dashpot, gravity and external force update of the velocity of particle (i, j)
+// springs stretched too far are broken here; both ends see the same length, so each one only clears its own bit
+template<int M, int N, typename T, typename Stats>
+inline void update_velocity(Cloth<M, N, T>& cloth, const int i, const int j, const T dt, Stats& stats)
+{
+	Vector3<T> force(cloth.external_force.coeff(i, j));
+	force.y() -= gravity;
+	std::uint16_t springs = cloth.springs.coeff(i, j);
+	for (int k = 0; k < static_cast<int>(spring_offset.size()); ++k)
+	{
+		auto& [offset_i, offset_j] = spring_offset[k];
+		int another_i = i + offset_i;
+		int another_j = j + offset_j;
+		if (another_i >= 0 && another_i < M && another_j >= 0 && another_j < N && (springs >> k & 1))
+		{
+			Vector3<T> x_diff(cloth.position.coeff(i, j) - cloth.position.coeff(another_i, another_j));
+			Vector3<T> v_diff(cloth.velocity.coeff(i, j) - cloth.velocity.coeff(another_i, another_j));
+			T original_dist = cloth.quad_size * (Vector2<T>(offset_i, offset_j).norm());
+			T tear_dist = (1 + cloth.tear_strain) * original_dist;
+			T squared_dist = x_diff.squaredNorm();
+			if (squared_dist > tear_dist * tear_dist)
+			{
+				springs &= ~(1 << k);
+				continue;
+			}
+			measure_spring(stats, spring_class[k], squared_dist, original_dist);
+
+			force += spring_force(x_diff, v_diff, original_dist, cloth.quad_size, stats);
+		}
+	}
+
+	if (springs != cloth.springs.coeff(i, j))
+		cloth.springs.coeffRef(i, j) = springs;
+	cloth.velocity.coeffRef(i, j) += (force * dt);
 }
 
+// drag, collision with balls and position update of particle (i, j)
+template<int M, int N, int Number, typename T, typename Stats>
+inline void update_position(Cloth<M, N, T>& cloth, const Balls<Number, T>& balls, const int i, const int j, const T dt, Stats& stats)
+{
+	move_particle(cloth.position.coeffRef(i, j), cloth.velocity.coeffRef(i, j), balls, dt, stats);
+	measure_particle(stats, cloth.position.coeff(i, j), cloth.velocity.coeff(i, j));
+}
 
 template<int M, int N, int Number, typename T=float>
-void substep(Cloth<M, N, T>& cloth, const Balls<Number, T>& balls, const T dt)
+Substep_stats<T> substep(Cloth<M, N, T>& cloth, const Balls<Number, T>& balls, const T dt)
 {
-	tbb::parallel_for(tbb::blocked_range2d<int>(0, M, 0, N), [&](const tbb::blocked_range2d<int>& r)
+	Substep_stats<T> stats = tbb::parallel_reduce(tbb::blocked_range2d<int>(0, M, 0, N), Substep_stats<T>(), [&](const tbb::blocked_range2d<int>& r, Substep_stats<T> stats)
 		{
 			for (int j = r.cols().begin(); j != r.cols().end(); ++j)
 			{
 				for (int i = r.rows().begin(); i != r.rows().end(); ++i)
 				{
-					Vector3<T> force(0., -9.8, 0.); //gravity
-					for (auto& offset : spring_offset)
-					{
-						auto& [offset_i, offset_j] = offset;
-						int another_i = i + offset_i;
-						int another_j = j + offset_j;
-						if (another_i >= 0 && another_i < M && another_j >= 0 && another_j < N)
-						{
-							Vector3<T> x_diff(cloth.position.coeff(i, j) - cloth.position.coeff(another_i, another_j));
-							Vector3<T> v_diff(cloth.velocity.coeff(i, j) - cloth.velocity.coeff(another_i, another_j));
-							T current_dist = x_diff.norm();
-							Vector3<T> d(x_diff / current_dist);
-							T original_dist = cloth.quad_size * (Vector2<T>(offset_i, offset_j).norm());
-
-							force += (-spring_Y * d * (current_dist / original_dist - 1)); //spring force
-							force += (-v_diff.dot(d) * d * dashpot_damping * cloth.quad_size); //dashpot damping
-						}
-					}
-
-					cloth.velocity.coeffRef(i, j) += (force * dt);
+					update_velocity(cloth, i, j, dt, stats);
 				}
 			}
-		}
+			return stats;
+		},
+		[](Substep_stats<T> a, const Substep_stats<T>& b) { return a.merge(b); }
 	);
 
-	tbb::parallel_for(tbb::blocked_range<int>(0, N), [&](const tbb::blocked_range<int>& r)
+	return stats.merge(tbb::parallel_reduce(tbb::blocked_range<int>(0, N), Substep_stats<T>(), [&](const tbb::blocked_range<int>& r, Substep_stats<T> stats)
 		{
 			for (int j = r.begin(); j != r.end(); ++j)
 			{
 				for (int i = 0; i < M; ++i)
 				{
-					cloth.velocity.coeffRef(i, j) *= std::expf(-drag_damping * dt);
-					for (int k = 0; k < Number; ++k)  //handling collision with balls
+					update_position(cloth, balls, i, j, dt, stats);
+				}
+			}
+			return stats;
+		},
+		[](Substep_stats<T> a, const Substep_stats<T>& b) { return a.merge(b); }
+	));
+}
+
+// same as substep, but tiles that have been asleep are skipped. See Cloth_sleep.
+template<int M, int N, int Number, typename T=float>
+Substep_stats<T> substep(Cloth<M, N, T>& cloth, const Balls<Number, T>& balls, const T dt, Cloth_sleep<M, N, T>& sleep)
+{
+	using Tiles = typename Cloth_sleep<M, N, T>::Tiles;
+	const std::vector<int>& active = sleep.collect_awake_tiles();
+
+	Substep_stats<T> stats = tbb::parallel_reduce(tbb::blocked_range<int>(0, static_cast<int>(active.size()), 1), Substep_stats<T>(), [&](const tbb::blocked_range<int>& r, Substep_stats<T> stats)
+		{
+			for (int k = r.begin(); k != r.end(); ++k)
+			{
+				int tile = active[k];
+				for (int j = Tiles::col_begin(tile); j != Tiles::col_end(tile); ++j)
+				{
+					for (int i = Tiles::row_begin(tile); i != Tiles::row_end(tile); ++i)
 					{
-						Vector3<T> offset_to_center(cloth.position.coeff(i, j) - balls.center.coeff(k));
-						if (offset_to_center.norm() <= balls.radius)
-						{
-							Vector3<T> normal(offset_to_center.normalized());
-							cloth.velocity.coeffRef(i, j) -= (std::min(cloth.velocity.coeff(i, j).dot(normal), static_cast<T>(0)) * normal);
-							cloth.velocity.coeffRef(i, j) *= fraction;
-						}
+						sleep.start_velocity.coeffRef(i, j) = cloth.velocity.coeff(i, j);
+						update_velocity(cloth, i, j, dt, stats);
 					}
-
-					cloth.position.coeffRef(i, j) += (cloth.velocity.coeffRef(i, j) * dt);
 				}
 			}
-		}
+			return stats;
+		},
+		[](Substep_stats<T> a, const Substep_stats<T>& b) { return a.merge(b); }
 	);
+
+	stats.merge(tbb::parallel_reduce(tbb::blocked_range<int>(0, static_cast<int>(active.size()), 1), Substep_stats<T>(), [&](const tbb::blocked_range<int>& r, Substep_stats<T> stats)
+		{
+			for (int k = r.begin(); k != r.end(); ++k)
+			{
+				int tile = active[k];
+				Substep_stats<T> tile_stats;
+				T max_change = 0;
+				for (int j = Tiles::col_begin(tile); j != Tiles::col_end(tile); ++j)
+				{
+					for (int i = Tiles::row_begin(tile); i != Tiles::row_end(tile); ++i)
+					{
+						update_position(cloth, balls, i, j, dt, tile_stats);
+						max_change = std::max(max_change, (cloth.velocity.coeff(i, j) - sleep.start_velocity.coeff(i, j)).squaredNorm());
+					}
+				}
+				// each tile is owned by one task, so its motion is stored without atomics
+				sleep.tile_speed[tile] = tile_stats.max_speed;
+				sleep.tile_residual[tile] = std::sqrt(max_change) / dt;
+				stats.merge(tile_stats);
+			}
+			return stats;
+		},
+		[](Substep_stats<T> a, const Substep_stats<T>& b) { return a.merge(b); }
+	));
+
+	sleep.update(cloth);
+	return stats;
+}
+
+// same as substep, but the Substep_diagnostics of the substep are measured as well. The sums are
+// reduced over a fixed tree of column blocks, so they don't depend on scheduling.
+template<int M, int N, int Number, typename T = float>
+Substep_stats<T> substep(Cloth<M, N, T>& cloth, const Balls<Number, T>& balls, const T dt, Substep_diagnostics<T>& diagnostics)
+{
+	constexpr int columns = 4;
+	auto sweep = [](auto update)
+	{
+		return tbb::parallel_deterministic_reduce(tbb::blocked_range<int>(0, N, columns), Substep_diagnostics<T>(), [&](const tbb::blocked_range<int>& r, Substep_diagnostics<T> diagnostics)
+			{
+				for (int j = r.begin(); j != r.end(); ++j)
+				{
+					for (int i = 0; i < M; ++i)
+					{
+						update(i, j, diagnostics);
+					}
+				}
+				return diagnostics;
+			},
+			[](Substep_diagnostics<T> a, const Substep_diagnostics<T>& b) { return a.merge(b); }
+		);
+	};
+
+	diagnostics = sweep([&](int i, int j, Substep_diagnostics<T>& diagnostics) { update_velocity(cloth, i, j, dt, diagnostics); });
+	diagnostics.merge(sweep([&](int i, int j, Substep_diagnostics<T>& diagnostics) { update_position(cloth, balls, i, j, dt, diagnostics); }));
+	return diagnostics;
+}
+
+// substep on the calling thread alone, particle after particle in a fixed order, so the result
+// doesn't depend on scheduling. For many small cloths simulated side by side.
+// stats may be a Substep_diagnostics to measure the substep as well
+template<int M, int N, int Number, typename T, typename Stats>
+Substep_stats<T> serial_substep(Cloth<M, N, T>& cloth, const Balls<Number, T>& balls, const T dt, Stats& stats)
+{
+	for (int j = 0; j < N; ++j)
+		for (int i = 0; i < M; ++i)
+			update_velocity(cloth, i, j, dt, stats);
+	for (int j = 0; j < N; ++j)
+		for (int i = 0; i < M; ++i)
+			update_position(cloth, balls, i, j, dt, stats);
+	return stats;
+}
+
+template<int M, int N, int Number, typename T = float>
+Substep_stats<T> serial_substep(Cloth<M, N, T>& cloth, const Balls<Number, T>& balls, const T dt)
+{
+	Substep_stats<T> stats;
+	return serial_substep(cloth, balls, dt, stats);
+}
+
+// advances by exactly frame_time, with substeps sized by timestep; returns the number of substeps
+// substep(dt) runs one substep and returns its Substep_stats<T>
+template<typename T, typename Substep>
+int advance(const T frame_time, Adaptive_timestep<T>& timestep, Substep substep)
+{
+	int steps = 0;
+	T simulated = 0;
+	while (simulated < frame_time)
+	{
+		T remaining = frame_time - simulated;
+		T step = timestep.dt;
+		if (remaining <= step)
+			step = remaining;
+		else if (remaining < step + timestep.dt_min)
+			step = remaining / 2; // don't leave a sliver for the last substep of the frame
+		Substep_stats<T> stats = substep(step);
+		simulated += step;
+		++steps;
+		timestep.next(stats);
+	}
+	return steps;
+}
+
+// advance with the parallel substep of the cloth; if sleep is given, settled tiles are skipped
+template<int M, int N, int Number, typename T = float>
+int advance(Cloth<M, N, T>& cloth, const Balls<Number, T>& balls, const T frame_time, Adaptive_timestep<T>& timestep, Cloth_sleep<M, N, T>* sleep = nullptr)
+{
+	return advance(frame_time, timestep, [&](const T dt) { return sleep ? substep(cloth, balls, dt, *sleep) : substep(cloth, balls, dt); });
 }
 
 
 template<int M, int N, typename T>
-inline Cloth_mesh<M, N, T>::Cloth_mesh() :bottom_left(M - 1, N - 1), up_right(M - 1, N - 1)
+inline Cloth_mesh<M, N, T>::Cloth_mesh() :tile_min(Mesh_tiles<M, N>::count), tile_max(Mesh_tiles<M, N>::count), bottom_left(M - 1, N - 1), up_right(M - 1, N - 1),
+	drawn_springs(M, N), row_changes(M - 1)
 {
+	drawn_springs.fill(all_springs);
 	int triangle_number = (M - 1) * (N - 1) * 2;
 	indices = new unsigned int[triangle_number * 3];
 	vertices = new T[M * N * 9]; // position, color and normal vector
 
-	memset(vertices, 0x00, sizeof(vertices));
+	memset(vertices, 0x00, sizeof(T) * M * N * 9);
 	tbb::parallel_for(tbb::blocked_range<int>(0, M-1), [&](const tbb::blocked_range<int>& r)
 		{
 			for (int i = r.begin(); i != r.end(); ++i)
@@ -290,62 +929,164 @@ inline void Cloth_mesh<M, N, T>::update_vertices(const Cloth<M, N, T>& cloth)
 {
 	update_triangles_normalvec(cloth);
 
-	tbb::parallel_for(tbb::blocked_range<int>(0, N), [&](const tbb::blocked_range<int>& r)
+	tbb::parallel_for(tbb::blocked_range<int>(0, Mesh_tiles<M, N>::count), [&](const tbb::blocked_range<int>& r)
 		{
-			for (int j = r.begin(); j != r.end(); ++j)
-			{
-				for (int i = 0; i < M; ++i)
-				{
-					int index = 9 * (i * N + j);
-					Vector3<T> position_ij(cloth.position.coeff(i, j));
+			for (int tile = r.begin(); tile != r.end(); ++tile)
+				update_tile_vertices(cloth, tile);
+		}
+	);
+}
 
-					//update position
-					vertices[index + 0] = position_ij.x();
-					vertices[index + 1] = position_ij.y();
-					vertices[index + 2] = position_ij.z();
+template<int M, int N, typename T>
+inline void Cloth_mesh<M, N, T>::update_tile_vertices(const Cloth<M, N, T>& cloth, int tile)
+{
+	using Tiles = Mesh_tiles<M, N>;
+	// a tile packs its vertices except the last row and column, which belong to the next tile
+	int i_begin = Tiles::row_begin(tile), i_end = Tiles::row_end(tile);
+	int j_begin = Tiles::col_begin(tile), j_end = Tiles::col_end(tile);
+	int i_packed = (i_end == M - 1) ? M : i_end;
+	int j_packed = (j_end == N - 1) ? N : j_end;
 
-					//update normal vector
-					//note that a vertex is joint with 6 triangles in our mesh
-					Vector3<T> normal(Vector3<T>::Zero());
-					if (i > 0 && i < M - 1 && j > 0 && j < N - 1)
-					{
-						normal = (bottom_left.coeff(i, j) + bottom_left.coeff(i - 1, j) + bottom_left.coeff(i, j - 1)
-							+ up_right.coeff(i - 1, j) + up_right.coeff(i, j - 1) + up_right.coeff(i - 1, j - 1));
-					}
+	Vector3<T> box_min(cloth.position.coeff(i_begin, j_begin));
+	Vector3<T> box_max(box_min);
+	for (int j = j_begin; j != j_packed; ++j)
+	{
+		for (int i = i_begin; i != i_packed; ++i)
+		{
+			int index = 9 * (i * N + j);
+			Vector3<T> position_ij(cloth.position.coeff(i, j));
+			box_min = box_min.cwiseMin(position_ij);
+			box_max = box_max.cwiseMax(position_ij);
 
-					vertices[index + 6] = normal.x();
-					vertices[index + 7] = normal.y();
-					vertices[index + 8] = normal.z();
-				}
+			//update position
+			vertices[index + 0] = position_ij.x();
+			vertices[index + 1] = position_ij.y();
+			vertices[index + 2] = position_ij.z();
+
+			//update normal vector
+			//note that a vertex is joint with 6 triangles in our mesh
+			Vector3<T> normal(Vector3<T>::Zero());
+			if (i > 0 && i < M - 1 && j > 0 && j < N - 1)
+			{
+				normal = (bottom_left.coeff(i, j) + bottom_left.coeff(i - 1, j) + bottom_left.coeff(i, j - 1)
+					+ up_right.coeff(i - 1, j) + up_right.coeff(i, j - 1) + up_right.coeff(i - 1, j - 1));
 			}
+
+			vertices[index + 6] = normal.x();
+			vertices[index + 7] = normal.y();
+			vertices[index + 8] = normal.z();
 		}
-	);
+	}
+
+	// the shared row and column still bound the triangles of this tile
+	for (int j = j_begin; j <= j_end; ++j)
+	{
+		box_min = box_min.cwiseMin(cloth.position.coeff(i_end, j));
+		box_max = box_max.cwiseMax(cloth.position.coeff(i_end, j));
+	}
+	for (int i = i_begin; i <= i_end; ++i)
+	{
+		box_min = box_min.cwiseMin(cloth.position.coeff(i, j_end));
+		box_max = box_max.cwiseMax(cloth.position.coeff(i, j_end));
+	}
+	tile_min[tile] = box_min;
+	tile_max[tile] = box_max;
 }
 
 template<int M, int N, typename T>
-inline void Cloth_mesh<M, N, T>::update_triangles_normalvec(const Cloth<M, N, T>& cloth)
+inline bool Cloth_mesh<M, N, T>::update_indices(const Cloth<M, N, T>& cloth)
 {
-	tbb::parallel_for(tbb::blocked_range<int>(0, N-1), [&](const tbb::blocked_range<int>& r)
+	changed_indices.clear();
+	if ((cloth.springs == drawn_springs).all())
+		return false;
+
+	// the bits of spring_offset (1, 0), (0, 1), (-1, 1), (-1, 0) and (0, -1)
+	constexpr int down = 9, right = 6, up_right_diagonal = 3, up = 2, left = 5;
+	constexpr int merge_gap = 48; // runs closer than this many indices are uploaded together
+	tbb::parallel_for(tbb::blocked_range<int>(0, M - 1), [&](const tbb::blocked_range<int>& r)
 		{
-			for (int j = r.begin(); j != r.end(); ++j)
+			for (int i = r.begin(); i != r.end(); ++i)
 			{
-				for (int i = 0; i < M-1; ++i)
+				std::vector<std::pair<int, int>>& changes = row_changes[i];
+				changes.clear();
+				for (int j = 0; j != N - 1; ++j)
 				{
-					Vector3<T> edge1(cloth.position.coeff(i + 1, j) - cloth.position.coeff(i, j));
-					Vector3<T> edge2(cloth.position.coeff(i, j + 1) - cloth.position.coeff(i, j));
-					Vector3<T> normal(edge1.cross(edge2));
-					normal /= normal.norm();
-					bottom_left.coeffRef(i, j) = normal;
-
-					edge1 = cloth.position.coeff(i + 1, j) - cloth.position.coeff(i + 1, j + 1);
-					edge2 = cloth.position.coeff(i, j + 1) - cloth.position.coeff(i + 1, j + 1);
-					normal = edge1.cross(edge2);
-					normal /= normal.norm();
-					up_right.coeffRef(i, j) = normal;
+					// a triangle is drawn while the springs along its three edges are intact
+					std::uint16_t corner = cloth.springs.coeff(i, j);
+					std::uint16_t below = cloth.springs.coeff(i + 1, j);
+					std::uint16_t opposite = cloth.springs.coeff(i + 1, j + 1);
+					bool diagonal = below >> up_right_diagonal & 1;
+					bool first = diagonal && (corner >> down & 1) && (corner >> right & 1);
+					bool second = diagonal && (opposite >> up & 1) && (opposite >> left & 1);
+
+					unsigned int quad[6];
+					quad[0] = (i * N + j);
+					quad[1] = first ? ((i + 1) * N + j) : quad[0];
+					quad[2] = first ? (i * N + j + 1) : quad[0];
+					quad[3] = ((i + 1) * N + j + 1);
+					quad[4] = second ? (i * N + j + 1) : quad[3];
+					quad[5] = second ? ((i + 1) * N + j) : quad[3];
+
+					int index = 6 * (i * (N - 1) + j);
+					if (std::equal(quad, quad + 6, indices + index))
+						continue;
+					std::copy(quad, quad + 6, indices + index);
+					if (!changes.empty() && changes.back().first + changes.back().second + merge_gap >= index)
+						changes.back().second = index + 6 - changes.back().first;
+					else
+						changes.emplace_back(index, 6);
 				}
 			}
 		}
 	);
+
+	for (auto& changes : row_changes)
+	{
+		for (auto& change : changes)
+		{
+			if (!changed_indices.empty() && changed_indices.back().first + changed_indices.back().second + merge_gap >= change.first)
+				changed_indices.back().second = change.first + change.second - changed_indices.back().first;
+			else
+				changed_indices.push_back(change);
+		}
+	}
+	drawn_springs = cloth.springs;
+	return !changed_indices.empty();
+}
+
+template<int M, int N, typename T>
+inline void Cloth_mesh<M, N, T>::update_triangles_normalvec(const Cloth<M, N, T>& cloth)
+{
+	tbb::parallel_for(tbb::blocked_range<int>(0, Mesh_tiles<M, N>::count), [&](const tbb::blocked_range<int>& r)
+		{
+			for (int tile = r.begin(); tile != r.end(); ++tile)
+				update_tile_normals(cloth, tile);
+		}
+	);
+}
+
+template<int M, int N, typename T>
+inline void Cloth_mesh<M, N, T>::update_tile_normals(const Cloth<M, N, T>& cloth, int tile)
+{
+	using Tiles = Mesh_tiles<M, N>;
+	for (int j = Tiles::col_begin(tile); j != Tiles::col_end(tile); ++j)
+	{
+		for (int i = Tiles::row_begin(tile); i != Tiles::row_end(tile); ++i)
+		{
+			// both triangles of a quad are wound so that their normals point the same way
+			Vector3<T> edge1(cloth.position.coeff(i, j + 1) - cloth.position.coeff(i, j));
+			Vector3<T> edge2(cloth.position.coeff(i + 1, j) - cloth.position.coeff(i, j));
+			Vector3<T> normal(edge1.cross(edge2));
+			normal /= normal.norm();
+			bottom_left.coeffRef(i, j) = normal;
+
+			edge1 = cloth.position.coeff(i + 1, j) - cloth.position.coeff(i + 1, j + 1);
+			edge2 = cloth.position.coeff(i, j + 1) - cloth.position.coeff(i + 1, j + 1);
+			normal = edge1.cross(edge2);
+			normal /= normal.norm();
+			up_right.coeffRef(i, j) = normal;
+		}
+	}
 }
 
 template<int Number, int X_SEGMENTS, int Y_SEGMENTS, typename T>
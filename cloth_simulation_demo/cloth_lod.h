@@ -0,0 +1,296 @@
+#pragma once
+#ifndef CLOTH_LOD_H_
+#define CLOTH_LOD_H_
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <tbb/parallel_for.h>
+
+#include "cloth.h"
+
+// Level of detail for the cloth mesh. The (M-1) x (N-1) quads are split into tiles of
+// tile_quads x tile_quads quads and level k of a tile samples every 2^k-th row and column
+// of the vertex grid (the last row and column of the tile are always kept).
+//
+// All index patterns are built once in tile local coordinates (vertex li * N + lj), so one
+// pattern serves every tile of the same shape and is drawn with the tile's first vertex as
+// base vertex. Neighbouring tiles differ by at most one level; along an edge shared with a
+// coarser tile, vertices the coarser tile doesn't have are collapsed onto the previous
+// coarse vertex, which keeps the mesh free of cracks and T-junctions.
+template<int M, int N, typename T = float>
+class Cloth_lod
+{
+public:
+	using Tiles = Mesh_tiles<M, N>;
+	static constexpr int tile_quads = Tiles::size;
+	static constexpr int levels = 4;
+
+	// one glDrawElementsBaseVertex call
+	struct Draw
+	{
+		int count;
+		int first; // offset into indices, in indices
+		int base_vertex;
+	};
+
+	Cloth_lod();
+	~Cloth_lod();
+
+	// chooses the level of every tile so that its screen space error stays below pixel_error
+	void select(const Cloth<M, N, T>& cloth, const glm::vec3& eye, float fov_y, int viewport_height);
+
+	// packs position and normal of the vertices referenced by the selected levels only,
+	// and the bounding box of each tile over those vertices
+	void pack_vertices(const Cloth<M, N, T>& cloth, Cloth_mesh<M, N, T>& mesh) const;
+	void pack_tile(const Cloth<M, N, T>& cloth, Cloth_mesh<M, N, T>& mesh, int tile) const; // one tile of pack_vertices
+
+public:
+	T pixel_error;
+
+	std::vector<unsigned int> indices; // every pattern, uploaded once
+	std::vector<int> level; // per tile
+	std::vector<Draw> draws; // per tile, valid after select
+	std::vector<std::pair<int, int>> upload_rows; // runs of (first row, row count) of vertices to upload, valid after select
+
+private:
+	enum Edge { TOP = 1, BOTTOM = 2, LEFT = 4, RIGHT = 8 };
+
+	static int tile_shape(int tile);
+	static void samples(int length, int stride, std::vector<int>& out);
+	void build_pattern(int rows, int cols, int stride, int coarse_edges);
+
+private:
+	// offset and count of the pattern for [shape][level][coarse edge mask]
+	std::vector<std::pair<int, int>> patterns;
+};
+
+template<int M, int N, typename T>
+inline Cloth_lod<M, N, T>::Cloth_lod() : pixel_error(2), level(Tiles::count, 0), draws(Tiles::count)
+{
+	// a tile is either full sized or the smaller last one in each direction
+	int last_rows = (M - 1) - (Tiles::rows - 1) * tile_quads;
+	int last_cols = (N - 1) - (Tiles::cols - 1) * tile_quads;
+	for (int shape = 0; shape < 4; ++shape)
+	{
+		int rows = (shape & 2) ? last_rows : tile_quads;
+		int cols = (shape & 1) ? last_cols : tile_quads;
+		for (int k = 0; k < levels; ++k)
+		{
+			for (int mask = 0; mask < 16; ++mask)
+			{
+				int first = static_cast<int>(indices.size());
+				build_pattern(rows, cols, 1 << k, mask);
+				patterns.emplace_back(first, static_cast<int>(indices.size()) - first);
+			}
+		}
+	}
+}
+
+template<int M, int N, typename T>
+inline Cloth_lod<M, N, T>::~Cloth_lod()
+{
+}
+
+template<int M, int N, typename T>
+inline int Cloth_lod<M, N, T>::tile_shape(int tile)
+{
+	int shape = 0;
+	if (tile / Tiles::cols == Tiles::rows - 1)
+		shape |= 2;
+	if (tile % Tiles::cols == Tiles::cols - 1)
+		shape |= 1;
+	return shape;
+}
+
+template<int M, int N, typename T>
+inline void Cloth_lod<M, N, T>::samples(int length, int stride, std::vector<int>& out)
+{
+	out.clear();
+	for (int p = 0; p < length; p += stride)
+		out.push_back(p);
+	out.push_back(length);
+}
+
+template<int M, int N, typename T>
+inline void Cloth_lod<M, N, T>::build_pattern(int rows, int cols, int stride, int coarse_edges)
+{
+	std::vector<int> row_samples, col_samples;
+	samples(rows, stride, row_samples);
+	samples(cols, stride, col_samples);
+
+	int coarse = 2 * stride;
+	auto collapse = [coarse](int p, int length) { return p == length ? p : p - p % coarse; };
+	auto vertex = [&](int li, int lj)
+	{
+		if ((li == 0 && (coarse_edges & TOP)) || (li == rows && (coarse_edges & BOTTOM)))
+			lj = collapse(lj, cols);
+		if ((lj == 0 && (coarse_edges & LEFT)) || (lj == cols && (coarse_edges & RIGHT)))
+			li = collapse(li, rows);
+		return static_cast<unsigned int>(li * N + lj);
+	};
+	auto triangle = [&](unsigned int a, unsigned int b, unsigned int c)
+	{
+		if (a != b && b != c && a != c)
+		{
+			indices.push_back(a);
+			indices.push_back(b);
+			indices.push_back(c);
+		}
+	};
+
+	// same triangulation as Cloth_mesh, on the sampled grid
+	for (size_t a = 0; a + 1 < row_samples.size(); ++a)
+	{
+		for (size_t b = 0; b + 1 < col_samples.size(); ++b)
+		{
+			int i0 = row_samples[a], i1 = row_samples[a + 1];
+			int j0 = col_samples[b], j1 = col_samples[b + 1];
+			triangle(vertex(i0, j0), vertex(i1, j0), vertex(i0, j1));
+			triangle(vertex(i1, j1), vertex(i0, j1), vertex(i1, j0));
+		}
+	}
+}
+
+template<int M, int N, typename T>
+inline void Cloth_lod<M, N, T>::select(const Cloth<M, N, T>& cloth, const glm::vec3& eye, float fov_y, int viewport_height)
+{
+	Vector3<T> eye_position(eye.x, eye.y, eye.z);
+	T pixels_per_unit_at_unit_distance = viewport_height / (2 * std::tan(fov_y / 2));
+
+	tbb::parallel_for(tbb::blocked_range<int>(0, Tiles::count), [&](const tbb::blocked_range<int>& r)
+		{
+			for (int tile = r.begin(); tile != r.end(); ++tile)
+			{
+				int i0 = Tiles::row_begin(tile), i1 = Tiles::row_end(tile);
+				int j0 = Tiles::col_begin(tile), j1 = Tiles::col_end(tile);
+
+				// bound the tile by its corners and middle vertex
+				const Vector3<T> points[5] = { cloth.position.coeff(i0, j0), cloth.position.coeff(i1, j0), cloth.position.coeff(i0, j1),
+					cloth.position.coeff(i1, j1), cloth.position.coeff((i0 + i1) / 2, (j0 + j1) / 2) };
+				Vector3<T> center(Vector3<T>::Zero());
+				for (auto& point : points)
+					center += point / 5;
+				T radius = 0;
+				for (auto& point : points)
+					radius = std::max(radius, (point - center).norm());
+				T distance = std::max((center - eye_position).norm() - radius, static_cast<T>(1e-3));
+
+				// skipping 2^k - 1 vertices can displace the surface by about that many quads
+				int k = 0;
+				while (k + 1 < levels && ((1 << (k + 1)) - 1) * cloth.quad_size * pixels_per_unit_at_unit_distance / distance <= pixel_error)
+					++k;
+				level[tile] = k;
+			}
+		}
+	);
+
+	// neighbouring tiles may differ by one level at most, so only coarsen-by-one patterns are needed
+	for (bool changed = true; changed;)
+	{
+		changed = false;
+		for (int tile = 0; tile < Tiles::count; ++tile)
+		{
+			int tile_i = tile / Tiles::cols, tile_j = tile % Tiles::cols;
+			int limit = level[tile];
+			if (tile_i > 0) limit = std::min(limit, level[tile - Tiles::cols] + 1);
+			if (tile_i < Tiles::rows - 1) limit = std::min(limit, level[tile + Tiles::cols] + 1);
+			if (tile_j > 0) limit = std::min(limit, level[tile - 1] + 1);
+			if (tile_j < Tiles::cols - 1) limit = std::min(limit, level[tile + 1] + 1);
+			if (limit != level[tile])
+			{
+				level[tile] = limit;
+				changed = true;
+			}
+		}
+	}
+
+	std::vector<char> referenced(M, 0);
+	std::vector<int> row_samples;
+	for (int tile = 0; tile < Tiles::count; ++tile)
+	{
+		int tile_i = tile / Tiles::cols, tile_j = tile % Tiles::cols;
+		int k = level[tile];
+		int mask = 0;
+		if (tile_i > 0 && level[tile - Tiles::cols] > k) mask |= TOP;
+		if (tile_i < Tiles::rows - 1 && level[tile + Tiles::cols] > k) mask |= BOTTOM;
+		if (tile_j > 0 && level[tile - 1] > k) mask |= LEFT;
+		if (tile_j < Tiles::cols - 1 && level[tile + 1] > k) mask |= RIGHT;
+
+		auto& pattern = patterns[(tile_shape(tile) * levels + k) * 16 + mask];
+		draws[tile] = Draw{ pattern.second, pattern.first, Tiles::row_begin(tile) * N + Tiles::col_begin(tile) };
+
+		samples(Tiles::row_end(tile) - Tiles::row_begin(tile), 1 << k, row_samples);
+		for (int li : row_samples)
+			referenced[Tiles::row_begin(tile) + li] = 1;
+	}
+
+	upload_rows.clear();
+	for (int i = 0; i < M; ++i)
+	{
+		if (!referenced[i])
+			continue;
+		if (!upload_rows.empty() && upload_rows.back().first + upload_rows.back().second == i)
+			++upload_rows.back().second;
+		else
+			upload_rows.emplace_back(i, 1);
+	}
+}
+
+template<int M, int N, typename T>
+inline void Cloth_lod<M, N, T>::pack_vertices(const Cloth<M, N, T>& cloth, Cloth_mesh<M, N, T>& mesh) const
+{
+	tbb::parallel_for(tbb::blocked_range<int>(0, Tiles::count), [&](const tbb::blocked_range<int>& r)
+		{
+			for (int tile = r.begin(); tile != r.end(); ++tile)
+				pack_tile(cloth, mesh, tile);
+		}
+	);
+}
+
+template<int M, int N, typename T>
+inline void Cloth_lod<M, N, T>::pack_tile(const Cloth<M, N, T>& cloth, Cloth_mesh<M, N, T>& mesh, int tile) const
+{
+	std::vector<int> row_samples, col_samples;
+	int i0 = Tiles::row_begin(tile), i1 = Tiles::row_end(tile);
+	int j0 = Tiles::col_begin(tile), j1 = Tiles::col_end(tile);
+	int stride = 1 << level[tile];
+	samples(i1 - i0, stride, row_samples);
+	samples(j1 - j0, stride, col_samples);
+
+	Vector3<T> box_min(cloth.position.coeff(i0, j0));
+	Vector3<T> box_max(box_min);
+	for (int li : row_samples)
+	{
+		// the last row and column belong to the next tile, unless there is none
+		bool packed_row = !(li == i1 - i0 && i1 != M - 1);
+		for (int lj : col_samples)
+		{
+			int i = i0 + li, j = j0 + lj;
+			Vector3<T> position_ij(cloth.position.coeff(i, j));
+			box_min = box_min.cwiseMin(position_ij);
+			box_max = box_max.cwiseMax(position_ij);
+			if (!packed_row || (lj == j1 - j0 && j1 != N - 1))
+				continue;
+			int index = 9 * (i * N + j);
+
+			// central differences stand in for the triangle normals of skipped vertices
+			Vector3<T> along_i(cloth.position.coeff(std::min(i + 1, M - 1), j) - cloth.position.coeff(std::max(i - 1, 0), j));
+			Vector3<T> along_j(cloth.position.coeff(i, std::min(j + 1, N - 1)) - cloth.position.coeff(i, std::max(j - 1, 0)));
+			Vector3<T> normal(along_j.cross(along_i));
+
+			mesh.vertices[index + 0] = position_ij.x();
+			mesh.vertices[index + 1] = position_ij.y();
+			mesh.vertices[index + 2] = position_ij.z();
+			mesh.vertices[index + 6] = normal.x();
+			mesh.vertices[index + 7] = normal.y();
+			mesh.vertices[index + 8] = normal.z();
+		}
+	}
+	mesh.tile_min[tile] = box_min;
+	mesh.tile_max[tile] = box_max;
+}
+
+#endif
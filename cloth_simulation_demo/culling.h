@@ -0,0 +1,131 @@
+#pragma once
+#ifndef CULLING_H_
+#define CULLING_H_
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cstdint>
+
+#include "cloth.h"
+#include "cloth_lod.h"
+
+// view frustum as 6 planes (a, b, c, d), a point p is inside when a*x + b*y + c*z + d >= 0 for all of them
+class Frustum
+{
+public:
+	// projection_view is projection * view, planes are extracted after Gribb and Hartmann
+	Frustum(const glm::mat4& projection_view);
+
+	bool intersects_box(const glm::vec3& box_min, const glm::vec3& box_max) const;
+	bool intersects_sphere(const glm::vec3& center, float radius) const;
+
+private:
+	glm::vec4 planes[6];
+};
+
+// argument arrays for one glMultiDrawElements(BaseVertex) call
+struct Multi_draw
+{
+	std::vector<GLsizei> counts;
+	std::vector<const void*> offsets; // byte offsets into the bound element buffer
+	std::vector<GLint> base_vertices;
+
+	void clear();
+	GLsizei size() const;
+};
+
+// visible tiles of the cloth, drawn with the patterns lod selected
+template<int M, int N, typename T = float>
+void cull_cloth(const Frustum& frustum, const Cloth_mesh<M, N, T>& mesh, const Cloth_lod<M, N, T>& lod, Multi_draw& draw);
+
+// visible balls of a Balls_mesh, whose index buffer keeps the triangles of each ball contiguous;
+// the mesh only gives the segment counts, which fix the index range of every ball
+template<int Number, int X_SEGMENTS, int Y_SEGMENTS, typename T = float>
+void cull_balls(const Frustum& frustum, const Balls<Number, T>& balls, const Balls_mesh<Number, X_SEGMENTS, Y_SEGMENTS, T>& mesh, Multi_draw& draw);
+
+inline Frustum::Frustum(const glm::mat4& projection_view)
+{
+	// glm matrices are column major, row r of the matrix is (m[0][r], m[1][r], m[2][r], m[3][r])
+	auto row = [&](int r) { return glm::vec4(projection_view[0][r], projection_view[1][r], projection_view[2][r], projection_view[3][r]); };
+	planes[0] = row(3) + row(0); // left
+	planes[1] = row(3) - row(0); // right
+	planes[2] = row(3) + row(1); // bottom
+	planes[3] = row(3) - row(1); // top
+	planes[4] = row(3) + row(2); // near
+	planes[5] = row(3) - row(2); // far
+	for (auto& plane : planes)
+		plane = plane * (1.0f / glm::length(glm::vec3(plane.x, plane.y, plane.z)));
+}
+
+inline bool Frustum::intersects_box(const glm::vec3& box_min, const glm::vec3& box_max) const
+{
+	for (auto& plane : planes)
+	{
+		// the corner furthest along the plane normal
+		glm::vec3 corner(plane.x >= 0 ? box_max.x : box_min.x, plane.y >= 0 ? box_max.y : box_min.y, plane.z >= 0 ? box_max.z : box_min.z);
+		if (plane.x * corner.x + plane.y * corner.y + plane.z * corner.z + plane.w < 0)
+			return false;
+	}
+	return true;
+}
+
+inline bool Frustum::intersects_sphere(const glm::vec3& center, float radius) const
+{
+	for (auto& plane : planes)
+	{
+		if (plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w < -radius)
+			return false;
+	}
+	return true;
+}
+
+inline void Multi_draw::clear()
+{
+	counts.clear();
+	offsets.clear();
+	base_vertices.clear();
+}
+
+inline GLsizei Multi_draw::size() const
+{
+	return static_cast<GLsizei>(counts.size());
+}
+
+template<int M, int N, typename T>
+inline void cull_cloth(const Frustum& frustum, const Cloth_mesh<M, N, T>& mesh, const Cloth_lod<M, N, T>& lod, Multi_draw& draw)
+{
+	draw.clear();
+	for (int tile = 0; tile < Mesh_tiles<M, N>::count; ++tile)
+	{
+		const Vector3<T>& box_min = mesh.tile_min[tile];
+		const Vector3<T>& box_max = mesh.tile_max[tile];
+		if (!frustum.intersects_box(glm::vec3(box_min.x(), box_min.y(), box_min.z()), glm::vec3(box_max.x(), box_max.y(), box_max.z())))
+			continue;
+
+		auto& tile_draw = lod.draws[tile];
+		draw.counts.push_back(tile_draw.count);
+		draw.offsets.push_back(reinterpret_cast<const void*>(static_cast<uintptr_t>(sizeof(unsigned int) * tile_draw.first)));
+		draw.base_vertices.push_back(tile_draw.base_vertex);
+	}
+}
+
+template<int Number, int X_SEGMENTS, int Y_SEGMENTS, typename T>
+inline void cull_balls(const Frustum& frustum, const Balls<Number, T>& balls, const Balls_mesh<Number, X_SEGMENTS, Y_SEGMENTS, T>&, Multi_draw& draw)
+{
+	draw.clear();
+	int count = 6 * X_SEGMENTS * Y_SEGMENTS;
+	for (int number = 0; number < Number; ++number)
+	{
+		const Vector3<T>& center = balls.center.coeff(number);
+		if (!frustum.intersects_sphere(glm::vec3(center.x(), center.y(), center.z()), balls.radius))
+			continue;
+
+		draw.counts.push_back(count);
+		draw.offsets.push_back(reinterpret_cast<const void*>(static_cast<uintptr_t>(sizeof(unsigned int) * count * number)));
+		draw.base_vertices.push_back(0);
+	}
+}
+
+#endif
@@ -0,0 +1,94 @@
+#pragma once
+#ifndef EGL_CONTEXT_H_
+#define EGL_CONTEXT_H_
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <cstring>
+#include <iostream>
+
+// OpenGL 3.3 core context without any window or display server, for offscreen rendering on
+// headless machines. Uses the surfaceless platform of Mesa (EGL_MESA_platform_surfaceless) when
+// it is there, which also covers llvmpipe software rendering, and the default display otherwise.
+// Rendering must go to a framebuffer object, there is no default framebuffer.
+class Egl_context
+{
+public:
+	Egl_context();
+	~Egl_context();
+
+	bool is_valid() const;
+
+	// for gladLoadGLLoader
+	static void* get_proc_address(const char* name);
+
+private:
+	EGLDisplay display;
+	EGLContext context;
+};
+
+inline Egl_context::Egl_context() : display(EGL_NO_DISPLAY), context(EGL_NO_CONTEXT)
+{
+	const char* client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (client_extensions && std::strstr(client_extensions, "EGL_MESA_platform_surfaceless"))
+	{
+		auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+		if (get_platform_display)
+			display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	}
+	if (display == EGL_NO_DISPLAY)
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	EGLint major = 0, minor = 0;
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+	{
+		std::cout << "ERROR::EGL::DISPLAY_NOT_INITIALIZED: " << eglGetError() << std::endl;
+		display = EGL_NO_DISPLAY;
+		return;
+	}
+
+	const EGLint config_attributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig config = nullptr;
+	EGLint config_count = 0;
+	if (!eglChooseConfig(display, config_attributes, &config, 1, &config_count) || config_count == 0)
+	{
+		// surfaceless displays may expose configs without any surface type
+		const EGLint any_surface[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+		eglChooseConfig(display, any_surface, &config, 1, &config_count);
+	}
+
+	const EGLint context_attributes[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE };
+	if (!eglBindAPI(EGL_OPENGL_API)
+		|| (context = eglCreateContext(display, config_count ? config : EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attributes)) == EGL_NO_CONTEXT
+		|| !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+	{
+		std::cout << "ERROR::EGL::CONTEXT_NOT_CREATED: " << eglGetError() << std::endl;
+		if (context != EGL_NO_CONTEXT)
+			eglDestroyContext(display, context);
+		context = EGL_NO_CONTEXT;
+	}
+}
+
+inline Egl_context::~Egl_context()
+{
+	if (display == EGL_NO_DISPLAY)
+		return;
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (context != EGL_NO_CONTEXT)
+		eglDestroyContext(display, context);
+	eglTerminate(display);
+}
+
+inline bool Egl_context::is_valid() const
+{
+	return context != EGL_NO_CONTEXT;
+}
+
+inline void* Egl_context::get_proc_address(const char* name)
+{
+	return reinterpret_cast<void*>(eglGetProcAddress(name));
+}
+
+#endif
@@ -0,0 +1,259 @@
+#pragma once
+#ifndef FRAME_GRAPH_H_
+#define FRAME_GRAPH_H_
+
+#include <tbb/flow_graph.h>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "cloth.h"
+#include "cloth_lod.h"
+
+// One frame of the cloth as a tbb flow graph rather than a sequence of full grid passes.
+// The velocity and position passes of every substep are split into tiles, and a tile only
+// waits for the tiles within reach of its springs: its velocity pass reads the particles of
+// its 8 neighbours, so it waits for their position pass of the previous substep, and its
+// position pass waits for the velocity pass of its neighbours, which must read its old
+// positions first. There is no barrier between substeps, distant tiles may be a few
+// substeps apart. The normals and vertices of a mesh tile are updated as soon as the last
+// substep is done around it.
+//
+// before_substeps runs ahead of the first substep and may use the cloth (wind, lod select),
+// beside_substeps runs concurrently with everything and must not touch the cloth or the
+// cloth mesh (rebuilding the ball mesh). Tile sleeping is not supported.
+//
+// If diagnostics is set, the last substep of the frame is measured into it, with the tiles
+// merged in order so the sums don't depend on scheduling.
+//
+// All substeps of a frame have the same dt, so the graph is built once for a number of
+// substeps and only rebuilt when that number changes. With Adaptive_timestep, dt is thus
+// chosen once per frame, see frame_substeps.
+template<int M, int N, int Number, typename T = float>
+class Frame_graph
+{
+public:
+	using Tiles = Tile_grid<M, N, 32>;
+
+	// with lod, vertices are packed by lod->pack_tile at its selected levels
+	Frame_graph(Cloth<M, N, T>& cloth, const Balls<Number, T>& balls, Cloth_mesh<M, N, T>& mesh, const Cloth_lod<M, N, T>* lod = nullptr);
+	~Frame_graph();
+
+	// runs substeps substeps of dt and updates the mesh, returns the maxima over all substeps
+	Substep_stats<T> run(int substeps, T dt);
+
+	// substeps for a frame of frame_time with steps of at most dt, rounded up to a multiple
+	// of 4 so that the graph isn't rebuilt for every small change of dt
+	static int frame_substeps(T frame_time, T dt);
+
+public:
+	std::function<void()> before_substeps;
+	std::function<void()> beside_substeps;
+	Substep_diagnostics<T>* diagnostics = nullptr;
+
+private:
+	using Node = tbb::flow::continue_node<tbb::flow::continue_msg>;
+
+	void build(int substeps);
+	Node& add(std::function<void()> body);
+
+	template<typename Update>
+	static void update_tile(int tile, Update update);
+
+	// tiles of Grid overlapping rows [i_first, i_last] and columns [j_first, j_last], clamped to the grid
+	template<typename Grid>
+	static std::vector<int> overlapping(int i_first, int i_last, int j_first, int j_last);
+
+private:
+	Cloth<M, N, T>& cloth;
+	const Balls<Number, T>& balls;
+	Cloth_mesh<M, N, T>& mesh;
+	const Cloth_lod<M, N, T>* lod;
+
+	std::unique_ptr<tbb::flow::graph> graph;
+	std::unique_ptr<tbb::flow::broadcast_node<tbb::flow::continue_msg>> start;
+	std::vector<std::unique_ptr<Node>> nodes;
+	int built_substeps;
+
+	T dt;
+	std::vector<Substep_stats<T>> tile_stats; // each tile is owned by its chain of nodes
+	std::vector<Substep_diagnostics<T>> tile_diagnostics;
+};
+
+template<int M, int N, int Number, typename T>
+inline Frame_graph<M, N, Number, T>::Frame_graph(Cloth<M, N, T>& cloth, const Balls<Number, T>& balls, Cloth_mesh<M, N, T>& mesh, const Cloth_lod<M, N, T>* lod)
+	: cloth(cloth), balls(balls), mesh(mesh), lod(lod), built_substeps(0), dt(0), tile_stats(Tiles::count), tile_diagnostics(Tiles::count)
+{
+}
+
+template<int M, int N, int Number, typename T>
+inline Frame_graph<M, N, Number, T>::~Frame_graph()
+{
+	// nodes must go before their graph
+	nodes.clear();
+	start.reset();
+}
+
+template<int M, int N, int Number, typename T>
+inline int Frame_graph<M, N, Number, T>::frame_substeps(T frame_time, T dt)
+{
+	int substeps = std::max(1, static_cast<int>(std::ceil(frame_time / dt)));
+	return (substeps + 3) / 4 * 4;
+}
+
+template<int M, int N, int Number, typename T>
+template<typename Grid>
+inline std::vector<int> Frame_graph<M, N, Number, T>::overlapping(int i_first, int i_last, int j_first, int j_last)
+{
+	int row_first = std::max(i_first, 0) / Grid::size, row_last = std::min(i_last / Grid::size, Grid::rows - 1);
+	int col_first = std::max(j_first, 0) / Grid::size, col_last = std::min(j_last / Grid::size, Grid::cols - 1);
+	std::vector<int> tiles;
+	for (int row = row_first; row <= row_last; ++row)
+		for (int col = col_first; col <= col_last; ++col)
+			tiles.push_back(row * Grid::cols + col);
+	return tiles;
+}
+
+template<int M, int N, int Number, typename T>
+inline typename Frame_graph<M, N, Number, T>::Node& Frame_graph<M, N, Number, T>::add(std::function<void()> body)
+{
+	nodes.push_back(std::make_unique<Node>(*graph, [body](const tbb::flow::continue_msg&)
+		{
+			body();
+			return tbb::flow::continue_msg();
+		}
+	));
+	return *nodes.back();
+}
+
+template<int M, int N, int Number, typename T>
+template<typename Update>
+inline void Frame_graph<M, N, Number, T>::update_tile(int tile, Update update)
+{
+	for (int j = Tiles::col_begin(tile); j != Tiles::col_end(tile); ++j)
+		for (int i = Tiles::row_begin(tile); i != Tiles::row_end(tile); ++i)
+			update(i, j);
+}
+
+template<int M, int N, int Number, typename T>
+inline void Frame_graph<M, N, Number, T>::build(int substeps)
+{
+	nodes.clear();
+	start.reset();
+	graph = std::make_unique<tbb::flow::graph>();
+	start = std::make_unique<tbb::flow::broadcast_node<tbb::flow::continue_msg>>(*graph);
+	built_substeps = substeps;
+
+	Node& before = add([this]() { if (before_substeps) before_substeps(); });
+	Node& beside = add([this]() { if (beside_substeps) beside_substeps(); });
+	tbb::flow::make_edge(*start, before);
+	tbb::flow::make_edge(*start, beside);
+
+	// particles within reach of the springs of a tile, the largest spring_offset is 2
+	constexpr int reach = 2;
+	std::vector<std::vector<int>> neighbours(Tiles::count);
+	for (int tile = 0; tile < Tiles::count; ++tile)
+	{
+		neighbours[tile] = overlapping<Tiles>(Tiles::row_begin(tile) - reach, Tiles::row_end(tile) - 1 + reach,
+			Tiles::col_begin(tile) - reach, Tiles::col_end(tile) - 1 + reach);
+	}
+
+	std::vector<Node*> position_nodes(Tiles::count, nullptr);
+	for (int step = 0; step < substeps; ++step)
+	{
+		bool last = step == substeps - 1;
+		std::vector<Node*> velocity_nodes(Tiles::count);
+		for (int tile = 0; tile < Tiles::count; ++tile)
+		{
+			velocity_nodes[tile] = &add([this, tile, last]()
+				{
+					if (last && diagnostics)
+						update_tile(tile, [&](int i, int j) { update_velocity(cloth, i, j, dt, tile_diagnostics[tile]); });
+					else
+						update_tile(tile, [&](int i, int j) { update_velocity(cloth, i, j, dt, tile_stats[tile]); });
+				}
+			);
+			if (step == 0)
+			{
+				tbb::flow::make_edge(before, *velocity_nodes[tile]);
+			}
+			else
+			{
+				for (int neighbour : neighbours[tile])
+					tbb::flow::make_edge(*position_nodes[neighbour], *velocity_nodes[tile]);
+			}
+		}
+		for (int tile = 0; tile < Tiles::count; ++tile)
+		{
+			position_nodes[tile] = &add([this, tile, last]()
+				{
+					if (last && diagnostics)
+						update_tile(tile, [&](int i, int j) { update_position(cloth, balls, i, j, dt, tile_diagnostics[tile]); });
+					else
+						update_tile(tile, [&](int i, int j) { update_position(cloth, balls, i, j, dt, tile_stats[tile]); });
+				}
+			);
+			for (int neighbour : neighbours[tile])
+				tbb::flow::make_edge(*velocity_nodes[neighbour], *position_nodes[tile]);
+		}
+	}
+
+	// mesh tiles are made of quads, quad (i, j) has the particles (i, j) to (i + 1, j + 1)
+	using Quads = Mesh_tiles<M, N>;
+	if (lod)
+	{
+		for (int tile = 0; tile < Quads::count; ++tile)
+		{
+			Node& pack = add([this, tile]() { lod->pack_tile(cloth, mesh, tile); });
+			// the normals are central differences over the neighbouring particles
+			for (int simulated : overlapping<Tiles>(Quads::row_begin(tile) - 1, Quads::row_end(tile) + 1, Quads::col_begin(tile) - 1, Quads::col_end(tile) + 1))
+				tbb::flow::make_edge(*position_nodes[simulated], pack);
+		}
+	}
+	else
+	{
+		std::vector<Node*> normal_nodes(Quads::count);
+		for (int tile = 0; tile < Quads::count; ++tile)
+		{
+			normal_nodes[tile] = &add([this, tile]() { mesh.update_tile_normals(cloth, tile); });
+			for (int simulated : overlapping<Tiles>(Quads::row_begin(tile), Quads::row_end(tile), Quads::col_begin(tile), Quads::col_end(tile)))
+				tbb::flow::make_edge(*position_nodes[simulated], *normal_nodes[tile]);
+		}
+		for (int tile = 0; tile < Quads::count; ++tile)
+		{
+			Node& pack = add([this, tile]() { mesh.update_tile_vertices(cloth, tile); });
+			// a vertex needs the normals of the quads before it
+			for (int neighbour : overlapping<Quads>(Quads::row_begin(tile) - 1, Quads::row_end(tile) - 1, Quads::col_begin(tile) - 1, Quads::col_end(tile) - 1))
+				tbb::flow::make_edge(*normal_nodes[neighbour], pack);
+		}
+	}
+}
+
+template<int M, int N, int Number, typename T>
+inline Substep_stats<T> Frame_graph<M, N, Number, T>::run(int substeps, T dt)
+{
+	if (substeps != built_substeps)
+		build(substeps);
+	this->dt = dt;
+	std::fill(tile_stats.begin(), tile_stats.end(), Substep_stats<T>());
+	if (diagnostics)
+		std::fill(tile_diagnostics.begin(), tile_diagnostics.end(), Substep_diagnostics<T>());
+
+	start->try_put(tbb::flow::continue_msg());
+	graph->wait_for_all();
+
+	Substep_stats<T> stats;
+	for (auto& tile : tile_stats)
+		stats.merge(tile);
+	if (diagnostics)
+	{
+		*diagnostics = Substep_diagnostics<T>();
+		for (auto& tile : tile_diagnostics)
+			diagnostics->merge(tile);
+		stats.merge(*diagnostics);
+	}
+	return stats;
+}
+
+#endif
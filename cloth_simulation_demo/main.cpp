@@ -7,8 +7,20 @@
 #include "cloth.h"
 #include "shader.h"
 #include "camera.h"
+#include "recorder.h"
+#include "metrics.h"
+#include "cloth_lod.h"
+#include "culling.h"
+#include "capture.h"
+#include "wind.h"
+#include "frame_graph.h"
+#ifdef CLOTH_HEADLESS_EGL
+#include "egl_context.h"
+#endif
 
+#include <chrono>
 #include <iostream>
+#include <memory>
 
 #define ASSERT(x) if(!(x)) __debugbreak();
 #define GLCALL(x) gl_clear_error();\
@@ -47,12 +59,47 @@ static constexpr int n = 128;
 static constexpr float quad_size = 1.0 / n;
 static constexpr float dt = 4e-2 / n;
 static constexpr int substeps = static_cast<int>(1.0 / 60 / dt);
+static constexpr float frame_time = substeps * dt; // simulated time per frame
+static constexpr bool adaptive_timestep = true; // substeps are resized by Adaptive_timestep, dt is only the initial guess
+static constexpr bool use_wind = false; // aerodynamic drag and lift of a gusty wind, see wind.h
+static constexpr bool use_tearing = false; // springs stretched beyond tear_strain break and leave holes in the mesh
+static constexpr float tear_strain = 0.3f;
+// run a frame as a graph of tile tasks without barriers between substeps, see frame_graph.h. Off by default:
+// the graph has no tile sleeping, and picks dt once per frame instead of after every substep
+static constexpr bool use_frame_graph = false;
+// energy, strain and penetration of the last substep of every frame written as csv, see metrics.h
+static constexpr bool write_metrics = false;
+static constexpr const char* metrics_path = "./cloth_metrics.csv";
+// settled tiles of the cloth are skipped by substep; gusts and tears would not wake them, the frame graph
+// has no sleep and sleeping tiles would be missing from the metrics
+static constexpr bool sleep_tiles = !use_wind && !use_tearing && !use_frame_graph && !write_metrics;
 
 static constexpr int ball_number = 5;
 static constexpr float ball_radius = 0.6 / ball_number;
 static constexpr int ball_mesh_resolution_x = 100;
 static constexpr int ball_mesh_resolution_y = 100;
 
+// lod and culling draw the tiles of the cloth with shared index patterns, which can't have holes
+static constexpr bool use_lod = !use_tearing; // draw distant parts of the cloth with coarser index patterns, see cloth_lod.h
+static constexpr bool use_culling = !use_tearing; // only submit cloth tiles and balls inside the view frustum
+
+// bake the simulation to disk, see recorder.h for the file layout
+static constexpr bool record_frames = false;
+static constexpr bool record_normals = false;
+static constexpr const char* record_path = "./cloth_frames.bin";
+
+// render to an offscreen framebuffer and write every frame as png, see capture.h; the camera turns
+// around the cloth instead of following the mouse. Builds with CLOTH_HEADLESS_EGL defined create an
+// EGL context without any window system and always render offscreen
+#ifdef CLOTH_HEADLESS_EGL
+static constexpr bool offscreen = true;
+#else
+static constexpr bool offscreen = false;
+#endif
+static constexpr int capture_frame_count = 600; // frames written before exiting
+static constexpr const char* capture_path = "./capture/frame_%05d.png";
+static constexpr float turntable_period = 10.f; // simulated seconds per turn of the camera
+
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_callback(GLFWwindow* window, double xpos_in, double ypos_in);
 void processInput(GLFWwindow* window);
@@ -77,16 +124,74 @@ int main()
 {
     Cloth<n, n> cloth(quad_size);
     cloth.initialize();
+    if (use_tearing)
+        cloth.tear_strain = tear_strain;
 
     Balls<ball_number> balls(ball_radius);
     balls.initialize();
 
+    Adaptive_timestep<float> timestep(quad_size, dt);
+    Cloth_sleep<n, n> sleep;
+    Cloth_wind<n, n> wind;
+
     Cloth_mesh<n, n> mesh;
     mesh.update_vertices(cloth);
+    Cloth_lod<n, n> lod;
+    if (!use_lod)
+        lod.pixel_error = 0; // culling draws the tiles of lod at full resolution
+    Multi_draw cloth_draw, balls_draw;
 
     Balls_mesh<ball_number,ball_mesh_resolution_x, ball_mesh_resolution_y> balls_mesh;
     balls_mesh.update_vertices(balls);
 
+    auto apply_wind = [&](float time)
+    {
+        if (use_lod)
+            mesh.update_triangles_normalvec(cloth); // pack_vertices doesn't compute the triangle normals
+        wind.apply(cloth, mesh, time);
+    };
+
+    // the graph selects the levels of lod at the start of the frame, a frame of motion hardly changes them
+    Frame_graph<n, n, ball_number> frame_graph(cloth, balls, mesh, use_lod ? &lod : nullptr);
+    float current_timestep = 0.f;
+    bool balls_moved = false;
+    frame_graph.before_substeps = [&]()
+    {
+        if (use_wind)
+            apply_wind(current_timestep);
+        if (use_lod || use_culling)
+            lod.select(cloth, camera.Position, glm::radians(45.0f), SCR_HEIGHT);
+    };
+    frame_graph.beside_substeps = [&]()
+    {
+        if (balls_moved)
+            balls_mesh.update_vertices(balls);
+    };
+
+    std::unique_ptr<Frame_recorder<n, n>> recorder;
+    if (record_frames)
+        recorder = std::make_unique<Frame_recorder<n, n>>(record_path, record_normals);
+
+    std::unique_ptr<Metrics_log<>> metrics;
+    Substep_diagnostics<float> diagnostics;
+    if (write_metrics)
+    {
+        metrics = std::make_unique<Metrics_log<>>(metrics_path);
+        frame_graph.diagnostics = &diagnostics;
+    }
+
+#ifdef CLOTH_HEADLESS_EGL
+    Egl_context egl;
+    if (!egl.is_valid())
+        return -1;
+    GLFWwindow* window = NULL;
+
+    if (!gladLoadGLLoader((GLADloadproc)Egl_context::get_proc_address))
+    {
+        std::cout << "Failed to initialize GLAD" << std::endl;
+        return -1;
+    }
+#else
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
@@ -95,6 +200,8 @@ int main()
 #ifdef __APPLE__
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
+    if (offscreen)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE); // the window only provides the context
 
     // glfw window creation
     GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "C++ cloth simulation", NULL, NULL);
@@ -117,6 +224,15 @@ int main()
         std::cout << "Failed to initialize GLAD" << std::endl;
         return -1;
     }
+#endif
+
+    std::unique_ptr<Frame_capture> capture;
+    if (offscreen)
+    {
+        capture = std::make_unique<Frame_capture>(SCR_WIDTH, SCR_HEIGHT, capture_path);
+        if (!capture->is_complete())
+            return -1;
+    }
     
     Shader cloth_shader("./shader/cloth_vertex_shader.txt", "./shader/cloth_fragment_shader.txt");
     Shader balls_shader("./shader/balls_vertex_shader.txt", "./shader/balls_fragment_shader.txt");
@@ -133,7 +249,10 @@ int main()
     glBufferData(GL_ARRAY_BUFFER, sizeof(float)*9*n*n, mesh.vertices, GL_STREAM_DRAW);
 
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int)*6*(n-1)*(n-1), mesh.indices, GL_STREAM_DRAW);
+    if (use_lod || use_culling)
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * lod.indices.size(), lod.indices.data(), GL_STATIC_DRAW);
+    else
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int)*6*(n-1)*(n-1), mesh.indices, GL_STREAM_DRAW);
 
     // position attribute
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 9 * sizeof(float), (void*)0);
@@ -169,12 +288,12 @@ int main()
 
     // render loop
     glEnable(GL_DEPTH_TEST);
-    float current_timestep = 0.f;
     int frame_count = 0;
-    while (!glfwWindowShouldClose(window))
+    auto capture_start = std::chrono::steady_clock::now();
+    while (offscreen ? capture->frames_captured() < capture_frame_count : !glfwWindowShouldClose(window))
     {
         // show fps
-        if (frame_count >= 8)
+        if (!offscreen && frame_count >= 8)
         {
             current_time = static_cast<float>(glfwGetTime());
             delta_time = current_time - last_time;
@@ -187,8 +306,11 @@ int main()
         };
 
         // input
-        processInput(window);
-        
+        if (!offscreen)
+            processInput(window);
+
+        if (capture)
+            capture->bind();
         glClearColor(0.f, 0.f, 0.f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -196,20 +318,81 @@ int main()
         {
             cloth.initialize();
             balls.initialize();
-            balls_mesh.update_vertices(balls);
-            glBindVertexArray(VAO_balls);
-            glBindBuffer(GL_ARRAY_BUFFER, VBO_balls);
-            glBufferData(GL_ARRAY_BUFFER, sizeof(float) * ball_number * (ball_mesh_resolution_x + 1) * (ball_mesh_resolution_y + 1) * 6, balls_mesh.vertices, GL_STATIC_DRAW);
+            sleep.wake_all();
+            balls_moved = true;
             current_timestep = 0.f;
         }
 
-        for (int i = 0; i < substeps; ++i)
+        if (offscreen)
         {
-            substep(cloth, balls, dt);
-            current_timestep += dt;
+            float angle = 2 * pi * capture->frames_captured() * frame_time / turntable_period;
+            camera.Position = glm::vec3(3.f * std::sin(angle), 0.f, 3.f * std::cos(angle));
         }
 
-        mesh.update_vertices(cloth);
+        int frame_substeps = 0;
+        if (use_frame_graph)
+        {
+            // with an adaptive timestep, dt is chosen once per frame
+            frame_substeps = adaptive_timestep ? Frame_graph<n, n, ball_number>::frame_substeps(frame_time, timestep.dt) : substeps;
+            Substep_stats<float> stats = frame_graph.run(frame_substeps, frame_time / frame_substeps);
+            if (adaptive_timestep)
+                timestep.next(stats);
+            current_timestep += frame_time;
+        }
+        else
+        {
+            if (balls_moved)
+                balls_mesh.update_vertices(balls);
+            if (use_wind)
+                apply_wind(current_timestep);
+
+            if (adaptive_timestep)
+            {
+                if (metrics)
+                    frame_substeps = advance(frame_time, timestep, [&](const float step) { return substep(cloth, balls, step, diagnostics); });
+                else
+                    frame_substeps = advance(cloth, balls, frame_time, timestep, sleep_tiles ? &sleep : nullptr);
+                current_timestep += frame_time;
+            }
+            else
+            {
+                frame_substeps = substeps;
+                for (int i = 0; i < substeps; ++i)
+                {
+                    if (sleep_tiles)
+                        substep(cloth, balls, dt, sleep);
+                    else if (metrics)
+                        substep(cloth, balls, dt, diagnostics);
+                    else
+                        substep(cloth, balls, dt);
+                    current_timestep += dt;
+                }
+            }
+
+            if (use_lod || use_culling)
+                lod.select(cloth, camera.Position, glm::radians(45.0f), SCR_HEIGHT);
+            if (use_lod)
+                lod.pack_vertices(cloth, mesh);
+            else
+                mesh.update_vertices(cloth);
+        }
+
+        if (balls_moved)
+        {
+            glBindVertexArray(VAO_balls);
+            glBindBuffer(GL_ARRAY_BUFFER, VBO_balls);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(float) * ball_number * (ball_mesh_resolution_x + 1) * (ball_mesh_resolution_y + 1) * 6, balls_mesh.vertices, GL_STATIC_DRAW);
+            balls_moved = false;
+        }
+        if (metrics)
+            metrics->write(current_timestep, frame_substeps, diagnostics);
+        if (recorder)
+        {
+            if (use_lod)
+                recorder->record(cloth); // lod only packs the vertices it references, the recorder derives the normals itself
+            else
+                recorder->record(cloth, mesh);
+        }
         
         // ---render cloth---
         cloth_shader.use();
@@ -218,7 +401,7 @@ int main()
         glm::mat4 view = glm::mat4(1.0f); // make sure to initialize matrix to identity matrix first
         glm::mat4 projection = glm::mat4(1.0f);
         projection = glm::perspective(glm::radians(45.0f), static_cast<float>(SCR_WIDTH) / static_cast<float>(SCR_HEIGHT), 0.1f, 100.0f);
-        view = camera.get_view_matrix();
+        view = offscreen ? glm::lookAt(camera.Position, glm::vec3(0.f), glm::vec3(0.f, 1.f, 0.f)) : camera.get_view_matrix();
 
         cloth_shader.set_matrix4f("model", model);
         cloth_shader.set_matrix4f("view", view);
@@ -230,9 +413,38 @@ int main()
 
         glBindVertexArray(VAO);
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 9 * n * n, mesh.vertices, GL_STREAM_DRAW);
+        if (use_tearing && mesh.update_indices(cloth))
+        {
+            // only the runs of indices of torn quads are uploaded
+            for (auto& [first, count] : mesh.changed_indices)
+                glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * first, sizeof(unsigned int) * count, mesh.indices + first);
+        }
+        if (use_lod)
+        {
+            // only rows of vertices referenced by the selected levels are uploaded
+            for (auto& [first_row, row_count] : lod.upload_rows)
+                glBufferSubData(GL_ARRAY_BUFFER, sizeof(float) * 9 * n * first_row, sizeof(float) * 9 * n * row_count, mesh.vertices + 9 * n * first_row);
+        }
+        else
+        {
+            glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 9 * n * n, mesh.vertices, GL_STREAM_DRAW);
+        }
 
-        glDrawElements(GL_TRIANGLES, (n-1)*(n-1)*6, GL_UNSIGNED_INT, 0);
+        Frustum frustum(projection * view);
+        if (use_culling)
+        {
+            cull_cloth(frustum, mesh, lod, cloth_draw);
+            glMultiDrawElementsBaseVertex(GL_TRIANGLES, cloth_draw.counts.data(), GL_UNSIGNED_INT, cloth_draw.offsets.data(), cloth_draw.size(), cloth_draw.base_vertices.data());
+        }
+        else if (use_lod)
+        {
+            for (auto& draw : lod.draws)
+                glDrawElementsBaseVertex(GL_TRIANGLES, draw.count, GL_UNSIGNED_INT, (void*)(sizeof(unsigned int) * draw.first), draw.base_vertex);
+        }
+        else
+        {
+            glDrawElements(GL_TRIANGLES, (n-1)*(n-1)*6, GL_UNSIGNED_INT, 0);
+        }
 
         // ---render balls---
         balls_shader.use();
@@ -248,15 +460,41 @@ int main()
 
         
         glBindVertexArray(VAO_balls);
-        glDrawElements(GL_TRIANGLES, ball_number * 6 * ball_mesh_resolution_x * ball_mesh_resolution_y, GL_UNSIGNED_INT, 0);
+        if (use_culling)
+        {
+            cull_balls(frustum, balls, balls_mesh, balls_draw);
+            glMultiDrawElements(GL_TRIANGLES, balls_draw.counts.data(), GL_UNSIGNED_INT, balls_draw.offsets.data(), balls_draw.size());
+        }
+        else
+        {
+            glDrawElements(GL_TRIANGLES, ball_number * 6 * ball_mesh_resolution_x * ball_mesh_resolution_y, GL_UNSIGNED_INT, 0);
+        }
  
-        // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        if (capture)
+        {
+            capture->capture();
+        }
+        else
+        {
+            // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+        }
 
         frame_count++;
     }
 
+    if (recorder)
+        recorder->close();
+    if (capture)
+    {
+        capture->finish();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - capture_start).count();
+        std::cout << "captured " << capture->frames_captured() << " frames at " << capture->frames_captured() / seconds << " FPS, "
+            << 1e3 * capture->stall_seconds() / capture->frames_captured() << " ms per frame waiting for readback or writers" << std::endl;
+        capture.reset(); // its buffers go before the context
+    }
+
     // glfw: terminate, clearing all previously allocated GLFW resources.
     glfwTerminate();
     return 0;
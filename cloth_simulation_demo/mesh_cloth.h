@@ -0,0 +1,539 @@
+#pragma once
+#ifndef MESH_CLOTH_H_
+#define MESH_CLOTH_H_
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/parallel_sort.h>
+
+#include "cloth.h"
+
+// Cloth on an arbitrary triangle mesh, loaded from an OBJ or ASCII PLY file. The rest shape is the
+// mesh as loaded. Springs are derived from the triangles:
+//   structural  every edge
+//   shear       the two vertices opposite an interior edge
+//   bending     a -> c where a - b - c are two edges that continue each other (almost) straight
+// On a triangulated grid this gives about 18 springs per vertex against the 12 of spring_offset.
+//
+// Coincident vertices, as OBJ files repeat along uv seams, are welded so no spring has zero rest
+// length. Vertices are renumbered along a Morton curve of the rest positions, triangles are sorted by
+// their first vertex and the springs of each vertex are kept in CSR form sorted by neighbour,
+// so the spring kernel walks memory mostly forward.
+template<typename T = float>
+class Mesh_cloth
+{
+public:
+	Mesh_cloth();
+	~Mesh_cloth();
+
+	// reads the mesh and builds the springs; false if the file can't be used
+	bool load(const std::string& path);
+	// same from vertex positions and triangles, indices into positions; vertices within weld_tolerance
+	// of the extent of the mesh are welded. false without any triangle or with a spring of no length
+	bool build(const std::vector<Vector3<T>>& input_positions, const std::vector<unsigned int>& input_triangles);
+
+	// back to the rest shape at rest, external_force is kept
+	void initialize();
+
+	int vertex_count() const;
+	int triangle_count() const;
+	int spring_count() const; // each spring is stored once per end
+	// explicit_stable_dt for these springs, the grid bound scaled to the stiffest vertex
+	T stable_dt() const;
+
+public:
+	Array<Vector3<T>, Dynamic, 1> position;
+	Array<Vector3<T>, Dynamic, 1> velocity;
+	Array<Vector3<T>, Dynamic, 1> rest_position;
+	Array<Vector3<T>, Dynamic, 1> external_force; // added to gravity in every substep, as on Cloth
+	std::vector<unsigned int> indices; // 3 per triangle, in the renumbered order
+
+	// springs of vertex v are spring_neighbour[spring_begin[v] .. spring_begin[v + 1])
+	std::vector<int> spring_begin;
+	std::vector<int> spring_neighbour;
+	std::vector<T> spring_length;
+
+	static constexpr T weld_tolerance = static_cast<T>(1e-6);
+
+	T damping_length; // mean edge length, plays the role of quad_size in the dashpot
+	T min_edge_length; // plays the role of quad_size in the cfl of Adaptive_timestep
+
+private:
+	bool load_obj(std::istream& in, std::vector<Vector3<T>>& positions, std::vector<unsigned int>& triangles) const;
+	bool load_ply(std::istream& in, std::vector<Vector3<T>>& positions, std::vector<unsigned int>& triangles) const;
+
+	static uint32_t spread_bits(uint32_t x);
+};
+
+// one substep of the mesh cloth, same integration as substep on the grid
+template<int Number, typename T = float>
+Substep_stats<T> substep(Mesh_cloth<T>& cloth, const Balls<Number, T>& balls, const T dt);
+
+template<typename T>
+inline Mesh_cloth<T>::Mesh_cloth() : damping_length(0), min_edge_length(0)
+{
+}
+
+template<typename T>
+inline Mesh_cloth<T>::~Mesh_cloth()
+{
+}
+
+template<typename T>
+inline int Mesh_cloth<T>::vertex_count() const
+{
+	return static_cast<int>(position.size());
+}
+
+template<typename T>
+inline int Mesh_cloth<T>::triangle_count() const
+{
+	return static_cast<int>(indices.size() / 3);
+}
+
+template<typename T>
+inline int Mesh_cloth<T>::spring_count() const
+{
+	return static_cast<int>(spring_neighbour.size());
+}
+
+template<typename T>
+inline T Mesh_cloth<T>::stable_dt() const
+{
+	// explicit_stable_dt takes omega^2 and gamma of the 12 springs of spring_offset, whose 1 / length
+	// add up to (6 + 2 * sqrt(2)) / quad_size; a vertex here has more and shorter springs, so both
+	// are scaled by the sums of the stiffest one
+	T stiffness = 0;
+	int springs = 0;
+	for (int v = 0; v < vertex_count(); ++v)
+	{
+		T sum = 0;
+		for (int s = spring_begin[v]; s != spring_begin[v + 1]; ++s)
+			sum += 1 / spring_length[s];
+		stiffness = std::max(stiffness, sum);
+		springs = std::max(springs, spring_begin[v + 1] - spring_begin[v]);
+	}
+	T grid_stiffness = 6 + 2 * std::sqrt(static_cast<T>(2));
+	return damped_stable_dt<T>(8 * spring_Y * stiffness / grid_stiffness, 8 * dashpot_damping * damping_length * springs / 12);
+}
+
+template<typename T>
+inline bool Mesh_cloth<T>::load(const std::string& path)
+{
+	std::ifstream file(path);
+	if (!file)
+	{
+		std::cout << "ERROR::MESH_CLOTH::FILE_NOT_OPENED: " << path << std::endl;
+		return false;
+	}
+
+	std::vector<Vector3<T>> positions;
+	std::vector<unsigned int> triangles;
+	std::string extension = path.substr(path.find_last_of('.') + 1);
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+	bool loaded = extension == "ply" ? load_ply(file, positions, triangles) : load_obj(file, positions, triangles);
+	if (!loaded)
+	{
+		std::cout << "ERROR::MESH_CLOTH::INVALID_MESH: " << path << std::endl;
+		return false;
+	}
+	return build(positions, triangles);
+}
+
+template<typename T>
+inline bool Mesh_cloth<T>::load_obj(std::istream& in, std::vector<Vector3<T>>& positions, std::vector<unsigned int>& triangles) const
+{
+	std::string line, token;
+	std::vector<unsigned int> face;
+	while (std::getline(in, line))
+	{
+		std::istringstream words(line);
+		words >> token;
+		if (token == "v")
+		{
+			T x, y, z;
+			if (!(words >> x >> y >> z))
+				return false;
+			positions.emplace_back(x, y, z);
+		}
+		else if (token == "f")
+		{
+			// v, v/vt, v//vn or v/vt/vn, negative indices count back from the last vertex
+			face.clear();
+			while (words >> token)
+			{
+				long index = std::strtol(token.c_str(), nullptr, 10);
+				index = index < 0 ? static_cast<long>(positions.size()) + index : index - 1;
+				if (index < 0 || index >= static_cast<long>(positions.size()))
+					return false;
+				face.push_back(static_cast<unsigned int>(index));
+			}
+			// polygons are split into a fan
+			for (size_t k = 2; k < face.size(); ++k)
+			{
+				triangles.push_back(face[0]);
+				triangles.push_back(face[k - 1]);
+				triangles.push_back(face[k]);
+			}
+		}
+		token.clear();
+	}
+	return true;
+}
+
+template<typename T>
+inline bool Mesh_cloth<T>::load_ply(std::istream& in, std::vector<Vector3<T>>& positions, std::vector<unsigned int>& triangles) const
+{
+	std::string line, word;
+	if (!std::getline(in, line) || line.compare(0, 3, "ply") != 0)
+		return false;
+
+	// only vertex x, y, z and the face index list are used, other properties are skipped
+	long vertex_number = 0, face_number = 0;
+	int vertex_properties = 0, x_property = -1, y_property = -1, z_property = -1;
+	std::string element;
+	while (std::getline(in, line))
+	{
+		std::istringstream words(line);
+		word.clear();
+		words >> word;
+		if (word == "format")
+		{
+			words >> word;
+			if (word != "ascii")
+				return false;
+		}
+		else if (word == "element")
+		{
+			long number = 0;
+			words >> element >> number;
+			if (element == "vertex")
+				vertex_number = number;
+			else if (element == "face")
+				face_number = number;
+		}
+		else if (word == "property" && element == "vertex")
+		{
+			std::string name;
+			while (words >> word)
+				name = word;
+			if (name == "x") x_property = vertex_properties;
+			if (name == "y") y_property = vertex_properties;
+			if (name == "z") z_property = vertex_properties;
+			++vertex_properties;
+		}
+		else if (word == "end_header")
+			break;
+	}
+	if (x_property < 0 || y_property < 0 || z_property < 0)
+		return false;
+
+	std::vector<T> values(vertex_properties);
+	for (long v = 0; v < vertex_number; ++v)
+	{
+		for (auto& value : values)
+		{
+			if (!(in >> value))
+				return false;
+		}
+		positions.emplace_back(values[x_property], values[y_property], values[z_property]);
+	}
+
+	std::vector<unsigned int> face;
+	for (long f = 0; f < face_number; ++f)
+	{
+		int count = 0;
+		if (!(in >> count))
+			return false;
+		face.resize(count);
+		for (auto& index : face)
+		{
+			if (!(in >> index) || index >= positions.size())
+				return false;
+		}
+		for (int k = 2; k < count; ++k)
+		{
+			triangles.push_back(face[0]);
+			triangles.push_back(face[k - 1]);
+			triangles.push_back(face[k]);
+		}
+	}
+	return true;
+}
+
+template<typename T>
+inline uint32_t Mesh_cloth<T>::spread_bits(uint32_t x)
+{
+	// 10 bits -> every third of 30 bits
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+template<typename T>
+inline bool Mesh_cloth<T>::build(const std::vector<Vector3<T>>& input_positions, const std::vector<unsigned int>& input_triangles)
+{
+	if (input_positions.empty() || input_triangles.size() < 3 || input_triangles.size() % 3 != 0)
+	{
+		std::cout << "ERROR::MESH_CLOTH::NO_TRIANGLES: " << input_positions.size() << " vertices, " << input_triangles.size() << " indices" << std::endl;
+		return false;
+	}
+	if (*std::max_element(input_triangles.begin(), input_triangles.end()) >= input_positions.size())
+	{
+		std::cout << "ERROR::MESH_CLOTH::INDEX_OUT_OF_RANGE: " << *std::max_element(input_triangles.begin(), input_triangles.end()) << std::endl;
+		return false;
+	}
+
+	Vector3<T> box_min(input_positions[0]), box_max(input_positions[0]);
+	for (auto& p : input_positions)
+	{
+		box_min = box_min.cwiseMin(p);
+		box_max = box_max.cwiseMax(p);
+	}
+	T extent = std::max((box_max - box_min).maxCoeff(), static_cast<T>(1e-12));
+
+	// vertices in the same cell of weld_tolerance * extent become one, OBJ files repeat them along
+	// uv seams; triangles left with a repeated vertex are dropped
+	T weld_length = weld_tolerance * extent;
+	std::vector<std::pair<std::array<int64_t, 3>, int>> cells(input_positions.size());
+	for (size_t v = 0; v < input_positions.size(); ++v)
+	{
+		Vector3<T> cell((input_positions[v] - box_min) / weld_length);
+		cells[v] = { { static_cast<int64_t>(cell.x()), static_cast<int64_t>(cell.y()), static_cast<int64_t>(cell.z()) }, static_cast<int>(v) };
+	}
+	std::sort(cells.begin(), cells.end());
+	std::vector<Vector3<T>> positions;
+	std::vector<unsigned int> welded(input_positions.size());
+	for (size_t k = 0; k < cells.size(); ++k)
+	{
+		if (k == 0 || cells[k].first != cells[k - 1].first)
+			positions.push_back(input_positions[cells[k].second]);
+		welded[cells[k].second] = static_cast<unsigned int>(positions.size() - 1);
+	}
+	std::vector<unsigned int> triangles;
+	triangles.reserve(input_triangles.size());
+	for (size_t t = 0; t < input_triangles.size(); t += 3)
+	{
+		unsigned int a = welded[input_triangles[t]], b = welded[input_triangles[t + 1]], c = welded[input_triangles[t + 2]];
+		if (a != b && b != c && c != a)
+			triangles.insert(triangles.end(), { a, b, c });
+	}
+	if (triangles.empty())
+	{
+		std::cout << "ERROR::MESH_CLOTH::NO_TRIANGLES: every triangle collapses when welding at " << weld_length << std::endl;
+		return false;
+	}
+	int vertices = static_cast<int>(positions.size());
+
+	// Morton order of the rest positions
+	std::vector<std::pair<uint32_t, int>> codes(vertices);
+	for (int v = 0; v < vertices; ++v)
+	{
+		Vector3<T> cell((positions[v] - box_min) * (1023 / extent));
+		codes[v] = { spread_bits(static_cast<uint32_t>(cell.x())) | (spread_bits(static_cast<uint32_t>(cell.y())) << 1)
+			| (spread_bits(static_cast<uint32_t>(cell.z())) << 2), v };
+	}
+	tbb::parallel_sort(codes.begin(), codes.end());
+	std::vector<unsigned int> new_index(vertices);
+	rest_position.resize(vertices);
+	for (int v = 0; v < vertices; ++v)
+	{
+		new_index[codes[v].second] = v;
+		rest_position.coeffRef(v) = positions[codes[v].second];
+	}
+
+	// triangles in the new numbering, winding kept, sorted by their lowest vertex
+	int triangle_number = static_cast<int>(triangles.size() / 3);
+	std::vector<std::pair<unsigned int, int>> order(triangle_number);
+	for (int t = 0; t < triangle_number; ++t)
+	{
+		unsigned int a = new_index[triangles[3 * t]], b = new_index[triangles[3 * t + 1]], c = new_index[triangles[3 * t + 2]];
+		order[t] = { std::min(a, std::min(b, c)), t };
+	}
+	std::sort(order.begin(), order.end());
+	indices.resize(3 * triangle_number);
+	for (int t = 0; t < triangle_number; ++t)
+	{
+		for (int k = 0; k < 3; ++k)
+			indices[3 * t + k] = new_index[triangles[3 * order[t].second + k]];
+	}
+
+	// edges with the vertex opposite them in each adjacent triangle, (low, high, opposite)
+	std::vector<std::pair<std::pair<int, int>, int>> edges;
+	edges.reserve(3 * triangle_number);
+	for (int t = 0; t < triangle_number; ++t)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			int a = indices[3 * t + k], b = indices[3 * t + (k + 1) % 3], c = indices[3 * t + (k + 2) % 3];
+			if (a != b)
+				edges.push_back({ { std::min(a, b), std::max(a, b) }, c });
+		}
+	}
+	std::sort(edges.begin(), edges.end());
+
+	std::vector<std::pair<int, int>> springs; // (low, high)
+	std::vector<std::vector<int>> edge_neighbours(vertices);
+	T length_sum = 0;
+	int edge_number = 0;
+	min_edge_length = std::numeric_limits<T>::max();
+	for (size_t e = 0; e < edges.size();)
+	{
+		size_t last = e;
+		while (last < edges.size() && edges[last].first == edges[e].first)
+			++last;
+		auto [a, b] = edges[e].first;
+		springs.push_back({ a, b });
+		edge_neighbours[a].push_back(b);
+		edge_neighbours[b].push_back(a);
+		T length = (rest_position.coeff(a) - rest_position.coeff(b)).norm();
+		length_sum += length;
+		min_edge_length = std::min(min_edge_length, length);
+		++edge_number;
+
+		// shear spring between the opposite vertices of the two triangles sharing the edge
+		for (size_t p = e; p < last; ++p)
+		{
+			for (size_t q = p + 1; q < last; ++q)
+			{
+				int c = edges[p].second, d = edges[q].second;
+				if (c != d)
+					springs.push_back({ std::min(c, d), std::max(c, d) });
+			}
+		}
+		e = last;
+	}
+	damping_length = length_sum / std::max(edge_number, 1);
+
+	// bending spring from a over b to the neighbour of b that continues a -> b the straightest
+	static constexpr T straight = static_cast<T>(0.9);
+	for (int b = 0; b < vertices; ++b)
+	{
+		for (int a : edge_neighbours[b])
+		{
+			Vector3<T> incoming((rest_position.coeff(b) - rest_position.coeff(a)).normalized());
+			int best = -1;
+			T best_cos = straight;
+			for (int c : edge_neighbours[b])
+			{
+				T cos = incoming.dot((rest_position.coeff(c) - rest_position.coeff(b)).normalized());
+				if (c != a && cos > best_cos)
+				{
+					best = c;
+					best_cos = cos;
+				}
+			}
+			if (best >= 0)
+				springs.push_back({ std::min(a, best), std::max(a, best) });
+		}
+	}
+
+	std::sort(springs.begin(), springs.end());
+	springs.erase(std::unique(springs.begin(), springs.end()), springs.end());
+
+	// CSR with both ends of every spring, neighbours ascending
+	spring_begin.assign(vertices + 1, 0);
+	for (auto& [a, b] : springs)
+	{
+		++spring_begin[a + 1];
+		++spring_begin[b + 1];
+	}
+	std::partial_sum(spring_begin.begin(), spring_begin.end(), spring_begin.begin());
+	spring_neighbour.resize(spring_begin[vertices]);
+	spring_length.resize(spring_begin[vertices]);
+	std::vector<int> fill(spring_begin.begin(), spring_begin.end() - 1);
+	for (auto& [a, b] : springs)
+	{
+		spring_neighbour[fill[a]++] = b;
+		spring_neighbour[fill[b]++] = a;
+	}
+	tbb::parallel_for(tbb::blocked_range<int>(0, vertices), [&](const tbb::blocked_range<int>& r)
+		{
+			for (int v = r.begin(); v != r.end(); ++v)
+			{
+				std::sort(spring_neighbour.begin() + spring_begin[v], spring_neighbour.begin() + spring_begin[v + 1]);
+				for (int s = spring_begin[v]; s != spring_begin[v + 1]; ++s)
+					spring_length[s] = (rest_position.coeff(v) - rest_position.coeff(spring_neighbour[s])).norm();
+			}
+		}
+	);
+	// vertices closer than weld_length but in neighbouring cells
+	T shortest = *std::min_element(spring_length.begin(), spring_length.end());
+	if (shortest < weld_length)
+	{
+		std::cout << "ERROR::MESH_CLOTH::ZERO_LENGTH_SPRING: " << shortest << " at weld length " << weld_length << std::endl;
+		*this = Mesh_cloth();
+		return false;
+	}
+
+	external_force.resize(vertices);
+	external_force.fill(Vector3<T>::Zero());
+	initialize();
+	return true;
+}
+
+template<typename T>
+inline void Mesh_cloth<T>::initialize()
+{
+	position = rest_position;
+	velocity.resize(rest_position.size());
+	tbb::parallel_for(tbb::blocked_range<int>(0, vertex_count()), [&](const tbb::blocked_range<int>& r)
+		{
+			for (int v = r.begin(); v != r.end(); ++v)
+				velocity.coeffRef(v) = Vector3<T>::Zero();
+		}
+	);
+}
+
+template<int Number, typename T>
+Substep_stats<T> substep(Mesh_cloth<T>& cloth, const Balls<Number, T>& balls, const T dt)
+{
+	int vertices = cloth.vertex_count();
+	Substep_stats<T> stats = tbb::parallel_reduce(tbb::blocked_range<int>(0, vertices), Substep_stats<T>(), [&](const tbb::blocked_range<int>& r, Substep_stats<T> stats)
+		{
+			for (int v = r.begin(); v != r.end(); ++v)
+			{
+				Vector3<T> force(cloth.external_force.coeff(v));
+				force.y() -= gravity;
+				for (int s = cloth.spring_begin[v]; s != cloth.spring_begin[v + 1]; ++s)
+				{
+					int another = cloth.spring_neighbour[s];
+					Vector3<T> x_diff(cloth.position.coeff(v) - cloth.position.coeff(another));
+					Vector3<T> v_diff(cloth.velocity.coeff(v) - cloth.velocity.coeff(another));
+					force += spring_force(x_diff, v_diff, cloth.spring_length[s], cloth.damping_length, stats);
+				}
+				cloth.velocity.coeffRef(v) += (force * dt);
+			}
+			return stats;
+		},
+		[](Substep_stats<T> a, const Substep_stats<T>& b) { return a.merge(b); }
+	);
+
+	return stats.merge(tbb::parallel_reduce(tbb::blocked_range<int>(0, vertices), Substep_stats<T>(), [&](const tbb::blocked_range<int>& r, Substep_stats<T> stats)
+		{
+			for (int v = r.begin(); v != r.end(); ++v)
+				move_particle(cloth.position.coeffRef(v), cloth.velocity.coeffRef(v), balls, dt, stats);
+			return stats;
+		},
+		[](Substep_stats<T> a, const Substep_stats<T>& b) { return a.merge(b); }
+	));
+}
+
+#endif
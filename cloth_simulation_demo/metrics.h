@@ -0,0 +1,78 @@
+#pragma once
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "cloth.h"
+
+// Per frame metrics of the cloth as csv, one row per frame from the Substep_diagnostics of the
+// last substep of the frame. Two runs of different solver modes from the same initial state can
+// be compared row by row; energies only drift apart slowly, while a broken solver shows up as
+// energy growing, strains beyond a few percent or particles deep inside the balls.
+template<typename T = float>
+class Metrics_log
+{
+public:
+	Metrics_log(const std::string& path);
+	~Metrics_log();
+
+	bool is_open() const;
+	// time is the simulated time at the end of the frame
+	void write(const T time, const int substeps, const Substep_diagnostics<T>& diagnostics);
+
+private:
+	std::FILE* file;
+	std::int64_t frame;
+};
+
+template<typename T>
+inline Metrics_log<T>::Metrics_log(const std::string& path) : frame(0)
+{
+	file = std::fopen(path.c_str(), "w");
+	if (!file)
+	{
+		std::cout << "ERROR::METRICS::FILE_NOT_OPENED: " << path << std::endl;
+		return;
+	}
+	std::fprintf(file, "frame,time,substeps,max_speed,max_strain_rate,kinetic_energy,spring_energy,gravity_energy,total_energy,"
+		"max_strain_structural,mean_strain_structural,max_strain_shear,mean_strain_shear,max_strain_bending,mean_strain_bending,"
+		"springs,max_penetration,contacts\n");
+}
+
+template<typename T>
+inline Metrics_log<T>::~Metrics_log()
+{
+	if (file)
+		std::fclose(file);
+}
+
+template<typename T>
+inline bool Metrics_log<T>::is_open() const
+{
+	return file != nullptr;
+}
+
+template<typename T>
+inline void Metrics_log<T>::write(const T time, const int substeps, const Substep_diagnostics<T>& diagnostics)
+{
+	if (!file)
+		return;
+
+	std::fprintf(file, "%lld,%.9g,%d,%.9g,%.9g,%.12g,%.12g,%.12g,%.12g", static_cast<long long>(frame++), static_cast<double>(time), substeps,
+		static_cast<double>(diagnostics.max_speed), static_cast<double>(diagnostics.max_strain_rate),
+		diagnostics.kinetic_energy, diagnostics.spring_energy, diagnostics.gravity_energy, diagnostics.total_energy());
+	std::int64_t spring_ends = 0;
+	for (int c = 0; c < Substep_diagnostics<T>::spring_classes; ++c)
+	{
+		std::fprintf(file, ",%.9g,%.9g", static_cast<double>(diagnostics.max_strain[c]), diagnostics.mean_strain(c));
+		spring_ends += diagnostics.spring_ends[c];
+	}
+	std::fprintf(file, ",%lld,%.9g,%lld\n", static_cast<long long>(spring_ends / 2), static_cast<double>(diagnostics.max_penetration),
+		static_cast<long long>(diagnostics.contacts));
+}
+
+#endif
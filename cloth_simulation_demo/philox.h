@@ -0,0 +1,93 @@
+#pragma once
+#ifndef PHILOX_H_
+#define PHILOX_H_
+
+#include <cstdint>
+
+// Philox4x32-10 counter based generator (Salmon et al., "Parallel random numbers: as easy as
+// 1, 2, 3"). The numbers are a keyed bijection of a 128 bit counter, so a stream needs no state
+// besides its key and position: the seed is the key, the stream number fills the upper half of
+// the counter and the lower half counts blocks of 4 numbers. Any scene of an ensemble gets its
+// own reproducible stream from (seed, scene), whichever thread runs it and in whatever order.
+// Satisfies UniformRandomBitGenerator, so it works with the std distributions.
+class Philox
+{
+public:
+	using result_type = std::uint32_t;
+
+	Philox(std::uint64_t seed, std::uint64_t stream = 0);
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return 0xffffffffu; }
+	result_type operator()();
+	void discard(std::uint64_t count);
+
+	// one block of the stream, for checking against the known answers of Random123
+	static void block(const std::uint32_t counter[4], const std::uint32_t key[2], std::uint32_t out[4]);
+
+private:
+	std::uint32_t key[2];
+	std::uint32_t counter[4];
+	std::uint32_t output[4];
+	int used; // numbers of output already returned
+};
+
+inline Philox::Philox(std::uint64_t seed, std::uint64_t stream) : used(4)
+{
+	key[0] = static_cast<std::uint32_t>(seed);
+	key[1] = static_cast<std::uint32_t>(seed >> 32);
+	counter[0] = 0;
+	counter[1] = 0;
+	counter[2] = static_cast<std::uint32_t>(stream);
+	counter[3] = static_cast<std::uint32_t>(stream >> 32);
+}
+
+inline void Philox::block(const std::uint32_t counter[4], const std::uint32_t key[2], std::uint32_t out[4])
+{
+	std::uint32_t c[4] = { counter[0], counter[1], counter[2], counter[3] };
+	std::uint32_t k[2] = { key[0], key[1] };
+	for (int round = 0; round < 10; ++round)
+	{
+		std::uint64_t product0 = static_cast<std::uint64_t>(0xD2511F53u) * c[0];
+		std::uint64_t product1 = static_cast<std::uint64_t>(0xCD9E8D57u) * c[2];
+		std::uint32_t next[4] = {
+			static_cast<std::uint32_t>(product1 >> 32) ^ c[1] ^ k[0], static_cast<std::uint32_t>(product1),
+			static_cast<std::uint32_t>(product0 >> 32) ^ c[3] ^ k[1], static_cast<std::uint32_t>(product0) };
+		c[0] = next[0]; c[1] = next[1]; c[2] = next[2]; c[3] = next[3];
+		k[0] += 0x9E3779B9u;
+		k[1] += 0xBB67AE85u;
+	}
+	out[0] = c[0]; out[1] = c[1]; out[2] = c[2]; out[3] = c[3];
+}
+
+inline Philox::result_type Philox::operator()()
+{
+	if (used == 4)
+	{
+		block(counter, key, output);
+		if (++counter[0] == 0)
+			++counter[1];
+		used = 0;
+	}
+	return output[used++];
+}
+
+inline void Philox::discard(std::uint64_t count)
+{
+	while (count > 0 && used < 4)
+	{
+		++used;
+		--count;
+	}
+	if (count == 0)
+		return;
+	// skip whole blocks by moving the counter
+	std::uint64_t blocks = count / 4;
+	std::uint64_t position = ((static_cast<std::uint64_t>(counter[1]) << 32) | counter[0]) + blocks;
+	counter[0] = static_cast<std::uint32_t>(position);
+	counter[1] = static_cast<std::uint32_t>(position >> 32);
+	for (count %= 4; count > 0; --count)
+		operator()();
+}
+
+#endif
@@ -0,0 +1,510 @@
+#pragma once
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+
+#include "cloth.h"
+
+// File layout (little endian):
+//   Record_header
+//   frame 0, frame 1, ...           each frame is a stream of zigzag varints
+//   Record_index_entry[frame_count] written on close, located by header.index_offset
+// Every keyframe_interval-th frame is a keyframe (delta against its spatial predecessor),
+// the others are deltas against the previous frame, so a chunk starts at every keyframe.
+// Values are quantized before the delta so that no error accumulates along a chunk.
+// Vertex order in a frame is i * N + j, the same as Cloth_mesh::vertices.
+
+static constexpr char record_magic[8] = { 'C','L','O','T','H','R','E','C' };
+static constexpr uint32_t record_version = 1;
+static constexpr uint32_t record_flag_normals = 1;
+static constexpr float record_normal_step = 1.0f / 1023;
+
+struct Record_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t rows;
+	uint32_t cols;
+	uint32_t flags;
+	float position_step;
+	uint32_t keyframe_interval;
+	uint64_t frame_count;
+	uint64_t index_offset;
+};
+
+struct Record_index_entry
+{
+	uint64_t offset;
+	uint32_t size;
+	uint32_t keyframe;
+};
+
+namespace record_codec
+{
+	// frames of large cloths can push the file past 2 GB, where long offsets overflow on windows
+	inline int seek(std::FILE* file, uint64_t offset)
+	{
+#ifdef _WIN32
+		return _fseeki64(file, static_cast<__int64>(offset), SEEK_SET);
+#else
+		return fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+	}
+
+	inline uint32_t zigzag(int32_t value)
+	{
+		return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+	}
+
+	inline int32_t unzigzag(uint32_t value)
+	{
+		return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+	}
+
+	inline void put_varint(std::vector<uint8_t>& out, uint32_t value)
+	{
+		while (value >= 0x80)
+		{
+			out.push_back(static_cast<uint8_t>(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back(static_cast<uint8_t>(value));
+	}
+
+	inline bool get_varint(const uint8_t*& in, const uint8_t* end, uint32_t& value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 35 && in != end; shift += 7)
+		{
+			uint8_t byte = *in++;
+			value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	// current and previous hold 3 interleaved channels; previous is empty for keyframes
+	inline void encode(const std::vector<int32_t>& current, const std::vector<int32_t>& previous, std::vector<uint8_t>& out)
+	{
+		out.reserve(current.size() * 2);
+		if (previous.empty())
+		{
+			int32_t last[3] = { 0, 0, 0 };
+			for (size_t k = 0; k < current.size(); ++k)
+			{
+				put_varint(out, zigzag(current[k] - last[k % 3]));
+				last[k % 3] = current[k];
+			}
+		}
+		else
+		{
+			for (size_t k = 0; k < current.size(); ++k)
+				put_varint(out, zigzag(current[k] - previous[k]));
+		}
+	}
+
+	// decodes in place: values holds the previous frame on entry unless keyframe is set
+	inline bool decode(const uint8_t*& in, const uint8_t* end, bool keyframe, std::vector<int32_t>& values)
+	{
+		int32_t last[3] = { 0, 0, 0 };
+		for (size_t k = 0; k < values.size(); ++k)
+		{
+			uint32_t code;
+			if (!get_varint(in, end, code))
+				return false;
+			if (keyframe)
+			{
+				last[k % 3] += unzigzag(code);
+				values[k] = last[k % 3];
+			}
+			else
+			{
+				values[k] += unzigzag(code);
+			}
+		}
+		return true;
+	}
+}
+
+// Streams cloth frames to disk. record() only quantizes the frame on the calling thread;
+// delta encoding and writing run in a separate task arena of two encoders so the simulation keeps going.
+// The encoding is plain zigzag varints of the deltas, no entropy coding: a 512 x 512 frame of a
+// falling cloth takes about 1 MB (3 MB as floats) and 7 to 12 ms of one core to quantize, encode
+// and write, about 60 MB/s of disk at 60 frames per second.
+template<int M, int N, typename T = float>
+class Frame_recorder
+{
+public:
+	Frame_recorder(const std::string& path, bool record_normals = false, T position_step = 1e-5, int keyframe_interval = 30, int max_frames_in_flight = 8);
+	~Frame_recorder();
+
+	bool is_open() const;
+	// with record_normals, these two derive the normals from the positions
+	void record(const Cloth<M, N, T>& cloth);
+	void record(const Array<Vector3<T>, Dynamic, Dynamic>& position); // positions of an M x N cloth
+	void record(const Cloth<M, N, T>& cloth, const Cloth_mesh<M, N, T>& mesh); // stores the vertex normals of the mesh
+	void close();
+
+private:
+	struct Frame
+	{
+		uint64_t number;
+		std::shared_ptr<const std::vector<int32_t>> positions;
+		std::shared_ptr<const std::vector<int32_t>> normals;
+	};
+
+	void submit(Frame frame);
+	void encode_and_write(const Frame& frame, const Frame& previous);
+
+private:
+	std::FILE* file;
+	Record_header header;
+	int max_frames_in_flight;
+
+	Frame last_frame;
+	uint64_t frame_number;
+
+	tbb::task_arena arena; // both slots go to encoders, none is reserved for the simulation thread
+	tbb::task_group group;
+
+	std::mutex write_mutex;
+	int frames_in_flight;
+	uint64_t next_frame_to_write;
+	uint64_t write_offset;
+	std::map<uint64_t, std::vector<uint8_t>> pending;
+	std::vector<Record_index_entry> index;
+};
+
+// Random access reader for files written by Frame_recorder. Decoding starts from the nearest
+// keyframe, or from the last decoded frame when scrubbing forward inside the same chunk.
+class Frame_reader
+{
+public:
+	Frame_reader(const std::string& path);
+	~Frame_reader();
+
+	bool is_open() const;
+	int rows() const;
+	int cols() const;
+	uint64_t frame_count() const;
+	bool has_normals() const;
+
+	// positions (and normals) receive 3 * rows * cols floats in i * cols + j order
+	bool read_frame(uint64_t frame, float* positions, float* normals = nullptr);
+
+private:
+	bool decode_frame(uint64_t frame);
+
+private:
+	std::FILE* file;
+	Record_header header;
+	std::vector<Record_index_entry> index;
+	std::vector<uint8_t> buffer;
+	std::vector<int32_t> positions;
+	std::vector<int32_t> normals;
+	int64_t decoded_frame;
+};
+
+template<int M, int N, typename T>
+inline Frame_recorder<M, N, T>::Frame_recorder(const std::string& path, bool record_normals, T position_step, int keyframe_interval, int max_frames_in_flight) :
+	header{}, max_frames_in_flight(max_frames_in_flight), frame_number(0), arena(2, 0), frames_in_flight(0), next_frame_to_write(0), write_offset(sizeof(Record_header))
+{
+	std::copy(record_magic, record_magic + 8, header.magic);
+	header.version = record_version;
+	header.rows = M;
+	header.cols = N;
+	header.flags = record_normals ? record_flag_normals : 0;
+	header.position_step = static_cast<float>(position_step);
+	header.keyframe_interval = static_cast<uint32_t>(std::max(keyframe_interval, 1));
+
+	file = std::fopen(path.c_str(), "wb");
+	if (!file)
+	{
+		std::cout << "ERROR::RECORDER::FILE_NOT_OPENED: " << path << std::endl;
+		return;
+	}
+	std::fwrite(&header, sizeof(header), 1, file);
+}
+
+template<int M, int N, typename T>
+inline Frame_recorder<M, N, T>::~Frame_recorder()
+{
+	close();
+}
+
+template<int M, int N, typename T>
+inline bool Frame_recorder<M, N, T>::is_open() const
+{
+	return file != nullptr;
+}
+
+template<int M, int N, typename T>
+inline void Frame_recorder<M, N, T>::record(const Cloth<M, N, T>& cloth)
+{
+	record(cloth.position);
+}
+
+template<int M, int N, typename T>
+inline void Frame_recorder<M, N, T>::record(const Array<Vector3<T>, Dynamic, Dynamic>& position)
+{
+	if (!file)
+		return;
+
+	auto positions = std::make_shared<std::vector<int32_t>>(3 * M * N);
+	std::shared_ptr<std::vector<int32_t>> normals;
+	if (header.flags & record_flag_normals)
+		normals = std::make_shared<std::vector<int32_t>>(3 * M * N);
+	T inverse_step = 1 / static_cast<T>(header.position_step);
+	T inverse_normal_step = 1 / static_cast<T>(record_normal_step);
+	tbb::parallel_for(tbb::blocked_range<int>(0, M), [&](const tbb::blocked_range<int>& r)
+		{
+			for (int i = r.begin(); i != r.end(); ++i)
+			{
+				for (int j = 0; j < N; ++j)
+				{
+					int index = 3 * (i * N + j);
+					for (int k = 0; k < 3; ++k)
+						(*positions)[index + k] = static_cast<int32_t>(std::lround(position.coeff(i, j).coeff(k) * inverse_step));
+					if (!normals)
+						continue;
+
+					// without a mesh the normals are central differences, one sided along the
+					// border, wound like the triangles of Cloth_mesh
+					Vector3<T> along_i(position.coeff(std::min(i + 1, M - 1), j) - position.coeff(std::max(i - 1, 0), j));
+					Vector3<T> along_j(position.coeff(i, std::min(j + 1, N - 1)) - position.coeff(i, std::max(j - 1, 0)));
+					Vector3<T> normal(along_j.cross(along_i));
+					T length = normal.norm();
+					if (length > 0)
+						normal /= length;
+					for (int k = 0; k < 3; ++k)
+						(*normals)[index + k] = static_cast<int32_t>(std::lround(normal.coeff(k) * inverse_normal_step));
+				}
+			}
+		}
+	);
+
+	submit(Frame{ frame_number++, positions, normals });
+}
+
+template<int M, int N, typename T>
+inline void Frame_recorder<M, N, T>::record(const Cloth<M, N, T>& cloth, const Cloth_mesh<M, N, T>& mesh)
+{
+	if (!file)
+		return;
+	if (!(header.flags & record_flag_normals))
+	{
+		record(cloth);
+		return;
+	}
+
+	auto positions = std::make_shared<std::vector<int32_t>>(3 * M * N);
+	auto normals = std::make_shared<std::vector<int32_t>>(3 * M * N);
+	T inverse_step = 1 / static_cast<T>(header.position_step);
+	T inverse_normal_step = 1 / static_cast<T>(record_normal_step);
+	tbb::parallel_for(tbb::blocked_range<int>(0, M), [&](const tbb::blocked_range<int>& r)
+		{
+			for (int i = r.begin(); i != r.end(); ++i)
+			{
+				for (int j = 0; j < N; ++j)
+				{
+					int index = 3 * (i * N + j);
+					Vector3<T> normal(mesh.vertices[3 * index + 6], mesh.vertices[3 * index + 7], mesh.vertices[3 * index + 8]);
+					T length = normal.norm();
+					if (length > 0)
+						normal /= length;
+					for (int k = 0; k < 3; ++k)
+					{
+						(*positions)[index + k] = static_cast<int32_t>(std::lround(cloth.position.coeff(i, j).coeff(k) * inverse_step));
+						(*normals)[index + k] = static_cast<int32_t>(std::lround(normal.coeff(k) * inverse_normal_step));
+					}
+				}
+			}
+		}
+	);
+
+	submit(Frame{ frame_number++, positions, normals });
+}
+
+template<int M, int N, typename T>
+inline void Frame_recorder<M, N, T>::submit(Frame frame)
+{
+	bool encoder_behind;
+	{
+		std::lock_guard<std::mutex> lock(write_mutex);
+		encoder_behind = frames_in_flight >= max_frames_in_flight;
+		++frames_in_flight;
+	}
+	if (encoder_behind)
+	{
+		// bound the memory held by queued frames; the calling thread joins the encoder, which
+		// also keeps recording alive when tbb has no spare worker for the arena
+		arena.execute([&] { group.wait(); });
+	}
+
+	Frame previous = (frame.number % header.keyframe_interval == 0) ? Frame{} : last_frame;
+	last_frame = frame;
+	arena.execute([&] { group.run([this, frame, previous] { encode_and_write(frame, previous); }); });
+}
+
+template<int M, int N, typename T>
+inline void Frame_recorder<M, N, T>::encode_and_write(const Frame& frame, const Frame& previous)
+{
+	static const std::vector<int32_t> empty;
+	std::vector<uint8_t> bytes;
+	record_codec::encode(*frame.positions, previous.positions ? *previous.positions : empty, bytes);
+	if (frame.normals)
+		record_codec::encode(*frame.normals, previous.normals ? *previous.normals : empty, bytes);
+
+	std::lock_guard<std::mutex> lock(write_mutex);
+	pending.emplace(frame.number, std::move(bytes));
+	// frames may finish out of order, write every frame that is now contiguous
+	for (auto it = pending.find(next_frame_to_write); it != pending.end(); it = pending.find(next_frame_to_write))
+	{
+		std::fwrite(it->second.data(), 1, it->second.size(), file);
+		index.push_back(Record_index_entry{ write_offset, static_cast<uint32_t>(it->second.size()), next_frame_to_write % header.keyframe_interval == 0 ? 1u : 0u });
+		write_offset += it->second.size();
+		pending.erase(it);
+		++next_frame_to_write;
+		--frames_in_flight;
+	}
+}
+
+template<int M, int N, typename T>
+inline void Frame_recorder<M, N, T>::close()
+{
+	if (!file)
+		return;
+
+	arena.execute([&] { group.wait(); });
+
+	header.frame_count = index.size();
+	header.index_offset = write_offset;
+	std::fwrite(index.data(), sizeof(Record_index_entry), index.size(), file);
+	record_codec::seek(file, 0);
+	std::fwrite(&header, sizeof(header), 1, file);
+	std::fclose(file);
+	file = nullptr;
+}
+
+inline Frame_reader::Frame_reader(const std::string& path) : header{}, decoded_frame(-1)
+{
+	file = std::fopen(path.c_str(), "rb");
+	if (!file)
+	{
+		std::cout << "ERROR::READER::FILE_NOT_OPENED: " << path << std::endl;
+		return;
+	}
+
+	if (std::fread(&header, sizeof(header), 1, file) != 1 || !std::equal(record_magic, record_magic + 8, header.magic) || header.version != record_version)
+	{
+		std::cout << "ERROR::READER::INVALID_HEADER: " << path << std::endl;
+		std::fclose(file);
+		file = nullptr;
+		return;
+	}
+
+	index.resize(header.frame_count);
+	record_codec::seek(file, header.index_offset);
+	if (std::fread(index.data(), sizeof(Record_index_entry), index.size(), file) != index.size())
+	{
+		std::cout << "ERROR::READER::INVALID_INDEX: " << path << std::endl;
+		std::fclose(file);
+		file = nullptr;
+		return;
+	}
+
+	positions.resize(3 * static_cast<size_t>(header.rows) * header.cols);
+	if (has_normals())
+		normals.resize(positions.size());
+}
+
+inline Frame_reader::~Frame_reader()
+{
+	if (file)
+		std::fclose(file);
+}
+
+inline bool Frame_reader::is_open() const
+{
+	return file != nullptr;
+}
+
+inline int Frame_reader::rows() const
+{
+	return static_cast<int>(header.rows);
+}
+
+inline int Frame_reader::cols() const
+{
+	return static_cast<int>(header.cols);
+}
+
+inline uint64_t Frame_reader::frame_count() const
+{
+	return header.frame_count;
+}
+
+inline bool Frame_reader::has_normals() const
+{
+	return (header.flags & record_flag_normals) != 0;
+}
+
+inline bool Frame_reader::read_frame(uint64_t frame, float* positions_out, float* normals_out)
+{
+	if (!file || frame >= header.frame_count)
+		return false;
+
+	uint64_t keyframe = frame - frame % header.keyframe_interval;
+	uint64_t first = (decoded_frame >= static_cast<int64_t>(keyframe) && decoded_frame <= static_cast<int64_t>(frame)) ? decoded_frame + 1 : keyframe;
+	for (uint64_t f = first; f <= frame; ++f)
+	{
+		if (!decode_frame(f))
+		{
+			decoded_frame = -1;
+			return false;
+		}
+		decoded_frame = static_cast<int64_t>(f);
+	}
+
+	for (size_t k = 0; k < positions.size(); ++k)
+		positions_out[k] = positions[k] * header.position_step;
+	if (normals_out && has_normals())
+	{
+		for (size_t k = 0; k < normals.size(); ++k)
+			normals_out[k] = normals[k] * record_normal_step;
+	}
+	return true;
+}
+
+inline bool Frame_reader::decode_frame(uint64_t frame)
+{
+	const Record_index_entry& entry = index[frame];
+	buffer.resize(entry.size);
+	record_codec::seek(file, entry.offset);
+	if (std::fread(buffer.data(), 1, buffer.size(), file) != buffer.size())
+		return false;
+
+	const uint8_t* in = buffer.data();
+	const uint8_t* end = in + buffer.size();
+	if (!record_codec::decode(in, end, entry.keyframe != 0, positions))
+		return false;
+	if (has_normals() && !record_codec::decode(in, end, entry.keyframe != 0, normals))
+		return false;
+	return true;
+}
+
+#endif
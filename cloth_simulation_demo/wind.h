@@ -0,0 +1,176 @@
+#pragma once
+#ifndef WIND_H_
+#define WIND_H_
+
+#include "cloth.h"
+
+// Wind velocity at a point and time: a steady wind, gusts travelling along it at its speed
+// and a swirl of three sine modes for turbulence. Evaluated on whole columns of points, so the
+// sines run on eigen packets.
+template<typename T = float>
+struct Wind_field
+{
+	Vector3<T> velocity{ T(3), T(0), T(1) }; // steady wind
+	T gust = 0.5; // amplitude of the gusts relative to the steady wind
+	T gust_length = 2; // distance between two gusts
+	T turbulence = 0.5; // amplitude of the swirl
+	T turbulence_length = 0.5;
+
+	template<typename Column>
+	void sample(const Column& x, const Column& y, const Column& z, const T time, Column& wind_x, Column& wind_y, Column& wind_z) const;
+};
+
+// Aerodynamic force on the cloth in a Wind_field. Each triangle of the mesh gets a drag force
+// along its normal and a lift force across the relative wind, from the velocity of the air
+// relative to the triangle at its centroid. The triangle forces go to the particles by a gather:
+// every particle sums a third of the forces of its 6 adjacent triangles, so no two tasks
+// write to the same particle.
+//
+// The normals are the ones of Cloth_mesh, apply needs them for the current positions of the
+// cloth (after update_vertices or update_triangles_normalvec). The result is written to
+// cloth.external_force, which is held over the substeps of the next frame.
+//
+// The coefficients are accelerations per squared relative wind speed of a flat cloth, they
+// include the air density and divide by the mass per area of the cloth, so a coefficient of 1
+// and a wind of 3 m/s straight onto the cloth are about as strong as gravity, whatever the
+// resolution. A real cloth of 200 g/m^2 has about drag = 3.
+template<int M, int N, typename T = float>
+class Cloth_wind
+{
+public:
+	Cloth_wind();
+
+	void apply(Cloth<M, N, T>& cloth, const Cloth_mesh<M, N, T>& mesh, const T time);
+	void clear(Cloth<M, N, T>& cloth) const;
+
+public:
+	Wind_field<T> field;
+	T drag = 1;
+	T lift = 0.5;
+
+private:
+	using Column = Array<T, M, 1>;
+	using Quad_column = Array<T, M - 1, 1>;
+
+	void triangle_forces(const Quad_column* corner[3][2], const Array<Vector3<T>, Dynamic, Dynamic>& normal, const int j, const T time,
+		Array<T, Dynamic, Dynamic>* force);
+
+	// forces of the triangles of quad (i, j) at (i + 1, j + 1), the border of zeros lets the gather skip the bounds checks
+	Array<T, Dynamic, Dynamic> bottom_left_force[3];
+	Array<T, Dynamic, Dynamic> up_right_force[3];
+};
+
+// column of component c of a field of the cloth, Vector3 is packed so the components have a stride of 3
+template<int M, typename T>
+inline Array<T, M, 1> load_column(const Array<Vector3<T>, Dynamic, Dynamic>& field, const int j, const int c)
+{
+	return Map<const Array<T, M, 1>, Unaligned, InnerStride<3>>(field.coeff(0, j).data() + c);
+}
+
+template<typename T>
+template<typename Column>
+inline void Wind_field<T>::sample(const Column& x, const Column& y, const Column& z, const T time, Column& wind_x, Column& wind_y, Column& wind_z) const
+{
+	T speed = velocity.norm();
+	Vector3<T> direction = speed > 0 ? Vector3<T>(velocity / speed) : Vector3<T>::Zero();
+	T gust_k = 2 * pi / gust_length;
+	T swirl_k = 2 * pi / turbulence_length;
+	T swirl_omega = swirl_k * std::max(speed, T(1));
+
+	Column strength = 1 + gust * (gust_k * (direction.x() * x + direction.y() * y + direction.z() * z - speed * time)).sin();
+	wind_x = velocity.x() * strength + turbulence * (swirl_k * y + swirl_omega * time).sin();
+	wind_y = velocity.y() * strength + turbulence * (swirl_k * z + 1.3f * swirl_omega * time).sin();
+	wind_z = velocity.z() * strength + turbulence * (swirl_k * x + 0.7f * swirl_omega * time).sin();
+}
+
+template<int M, int N, typename T>
+inline Cloth_wind<M, N, T>::Cloth_wind()
+{
+	for (int c = 0; c < 3; ++c)
+	{
+		bottom_left_force[c] = Array<T, Dynamic, Dynamic>::Zero(M + 1, N + 1);
+		up_right_force[c] = Array<T, Dynamic, Dynamic>::Zero(M + 1, N + 1);
+	}
+}
+
+template<int M, int N, typename T>
+inline void Cloth_wind<M, N, T>::triangle_forces(const Quad_column* corner[3][2], const Array<Vector3<T>, Dynamic, Dynamic>& normal, const int j, const T time,
+	Array<T, Dynamic, Dynamic>* force)
+{
+	// corner[k][0] and [1] are the positions and velocities of the k-th corner of the triangles
+	Quad_column x[3], v[3], n[3], wind[3];
+	for (int c = 0; c < 3; ++c)
+	{
+		x[c] = (corner[0][0][c] + corner[1][0][c] + corner[2][0][c]) * (T(1) / 3);
+		v[c] = (corner[0][1][c] + corner[1][1][c] + corner[2][1][c]) * (T(1) / 3);
+		n[c] = load_column<M - 1>(normal, j, c);
+		n[c] = n[c].isFinite().select(n[c], T(0)); // degenerate triangles have no normal
+	}
+	field.sample(x[0], x[1], x[2], time, wind[0], wind[1], wind[2]);
+
+	Quad_column relative[3];
+	for (int c = 0; c < 3; ++c)
+		relative[c] = wind[c] - v[c];
+	Quad_column speed = (relative[0].square() + relative[1].square() + relative[2].square()).sqrt();
+	Quad_column normal_speed = relative[0] * n[0] + relative[1] * n[1] + relative[2] * n[2];
+	Quad_column cos_speed = normal_speed / speed.max(T(1e-6));
+
+	// a triangle has half the area of a quad, which carries the mass of one particle, and gives a third of its force to each corner
+	for (int c = 0; c < 3; ++c)
+	{
+		force[c].col(j + 1).segment(1, M - 1) = (T(1) / 6) * (drag * normal_speed * normal_speed.abs() * n[c]
+			+ lift * normal_speed * (speed * n[c] - cos_speed * relative[c]));
+	}
+}
+
+template<int M, int N, typename T>
+inline void Cloth_wind<M, N, T>::apply(Cloth<M, N, T>& cloth, const Cloth_mesh<M, N, T>& mesh, const T time)
+{
+	tbb::parallel_for(tbb::blocked_range<int>(0, N - 1), [&](const tbb::blocked_range<int>& r)
+		{
+			for (int j = r.begin(); j != r.end(); ++j)
+			{
+				// quad (i, j) has the corners (i, j), (i + 1, j), (i, j + 1), (i + 1, j + 1)
+				Quad_column corner[4][2][3];
+				for (int c = 0; c < 3; ++c)
+				{
+					Column x0 = load_column<M>(cloth.position, j, c), x1 = load_column<M>(cloth.position, j + 1, c);
+					Column v0 = load_column<M>(cloth.velocity, j, c), v1 = load_column<M>(cloth.velocity, j + 1, c);
+					corner[0][0][c] = x0.head(M - 1); corner[0][1][c] = v0.head(M - 1);
+					corner[1][0][c] = x0.tail(M - 1); corner[1][1][c] = v0.tail(M - 1);
+					corner[2][0][c] = x1.head(M - 1); corner[2][1][c] = v1.head(M - 1);
+					corner[3][0][c] = x1.tail(M - 1); corner[3][1][c] = v1.tail(M - 1);
+				}
+				const Quad_column* bottom_left[3][2] = { { corner[0][0], corner[0][1] }, { corner[1][0], corner[1][1] }, { corner[2][0], corner[2][1] } };
+				const Quad_column* up_right[3][2] = { { corner[3][0], corner[3][1] }, { corner[2][0], corner[2][1] }, { corner[1][0], corner[1][1] } };
+				triangle_forces(bottom_left, mesh.bottom_left, j, time, bottom_left_force);
+				triangle_forces(up_right, mesh.up_right, j, time, up_right_force);
+			}
+		}
+	);
+
+	tbb::parallel_for(tbb::blocked_range<int>(0, N), [&](const tbb::blocked_range<int>& r)
+		{
+			for (int j = r.begin(); j != r.end(); ++j)
+			{
+				// particle (i, j) is a corner of bottom_left (i, j), (i - 1, j), (i, j - 1) and up_right (i - 1, j), (i, j - 1), (i - 1, j - 1)
+				for (int c = 0; c < 3; ++c)
+				{
+					const Array<T, Dynamic, Dynamic>& bl = bottom_left_force[c];
+					const Array<T, Dynamic, Dynamic>& ur = up_right_force[c];
+					Map<Column, Unaligned, InnerStride<3>>(cloth.external_force.coeffRef(0, j).data() + c) =
+						bl.col(j + 1).template segment<M>(1) + bl.col(j + 1).template segment<M>(0) + bl.col(j).template segment<M>(1)
+						+ ur.col(j + 1).template segment<M>(0) + ur.col(j).template segment<M>(1) + ur.col(j).template segment<M>(0);
+				}
+			}
+		}
+	);
+}
+
+template<int M, int N, typename T>
+inline void Cloth_wind<M, N, T>::clear(Cloth<M, N, T>& cloth) const
+{
+	cloth.external_force.fill(Vector3<T>::Zero());
+}
+
+#endif
@@ -0,0 +1,193 @@
+#pragma once
+#ifndef ENSEMBLE_H_
+#define ENSEMBLE_H_
+
+#include <tbb/parallel_pipeline.h>
+#include <tbb/task_arena.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../cloth_simulation_demo/cloth.h"
+#include "../cloth_simulation_demo/philox.h"
+#include "../cloth_simulation_demo/recorder.h"
+
+// Many randomized drops of the demo scene, a cloth falling onto balls for scene_frames frames.
+// Scene k draws its offsets and ball centers from Philox(seed, k), so it comes out the same
+// whichever thread runs it and whichever other scenes run in the same call.
+//
+// Small scenes run one per task, each on a single thread with serial_substep, and throughput
+// grows with the number of scenes in flight. Cloths of tile_granularity_particles and more run
+// one after another with the parallel substep over tiles instead, which keeps the memory of the
+// scenes in flight bounded; their velocity pass is then scheduling dependent like in the demo.
+//
+// Scenes are written in order as they finish, to a Frame_recorder file with one chunk per
+// scene (frames 0, record_interval, 2 record_interval, ... of the scene, so scene k starts at
+// frame k * recorded_frames) and a table of the scenes next to it, path + ".scenes.csv".
+template<int M, int N, int Number, typename T = float>
+class Ensemble
+{
+public:
+	static constexpr int tile_granularity_particles = 256 * 256;
+	static constexpr bool scene_granularity = M * N < tile_granularity_particles;
+
+	Ensemble(const std::string& path, std::uint64_t seed, T ball_radius, int scene_frames = 90, int record_interval = 10);
+	~Ensemble();
+
+	bool is_open() const;
+	int recorded_frames() const;
+
+	// simulates scenes first to first + count - 1 and appends them to the files
+	void run(std::uint64_t first, std::uint64_t count);
+
+public:
+	T frame_time;
+	T initial_dt;
+	int max_scenes_in_flight;
+
+private:
+	struct Scene
+	{
+		std::uint64_t index;
+		Array<Vector3<T>, Number, 1> center;
+		std::vector<Array<Vector3<T>, Dynamic, Dynamic>> frames;
+		int substeps;
+		Substep_stats<T> stats;
+	};
+
+	void simulate(Scene& scene) const;
+	void write(const Scene& scene);
+
+private:
+	std::uint64_t seed;
+	T ball_radius;
+	int scene_frames;
+	int record_interval;
+	Frame_recorder<M, N, T> recorder;
+	std::FILE* scene_table;
+};
+
+template<int M, int N, int Number, typename T>
+inline Ensemble<M, N, Number, T>::Ensemble(const std::string& path, std::uint64_t seed, T ball_radius, int scene_frames, int record_interval) :
+	frame_time(static_cast<T>(1.0 / 60)), initial_dt(static_cast<T>(4e-2) / std::max(M, N)),
+	max_scenes_in_flight(scene_granularity ? 2 * tbb::this_task_arena::max_concurrency() : 2),
+	seed(seed), ball_radius(ball_radius), scene_frames(scene_frames), record_interval(std::max(record_interval, 1)),
+	recorder(path, false, static_cast<T>(1e-5), scene_frames / std::max(record_interval, 1) + 1)
+{
+	scene_table = std::fopen((path + ".scenes.csv").c_str(), "w");
+	if (!scene_table)
+	{
+		std::cout << "ERROR::ENSEMBLE::FILE_NOT_OPENED: " << path << ".scenes.csv" << std::endl;
+		return;
+	}
+	std::fprintf(scene_table, "scene,seed,substeps,max_speed,max_strain_rate");
+	for (int k = 0; k < Number; ++k)
+		std::fprintf(scene_table, ",ball%d_x,ball%d_y,ball%d_z", k, k, k);
+	std::fprintf(scene_table, "\n");
+}
+
+template<int M, int N, int Number, typename T>
+inline Ensemble<M, N, Number, T>::~Ensemble()
+{
+	if (scene_table)
+		std::fclose(scene_table);
+}
+
+template<int M, int N, int Number, typename T>
+inline bool Ensemble<M, N, Number, T>::is_open() const
+{
+	return recorder.is_open() && scene_table;
+}
+
+template<int M, int N, int Number, typename T>
+inline int Ensemble<M, N, Number, T>::recorded_frames() const
+{
+	return scene_frames / record_interval + 1;
+}
+
+template<int M, int N, int Number, typename T>
+inline void Ensemble<M, N, Number, T>::simulate(Scene& scene) const
+{
+	Philox random(seed, scene.index);
+	Cloth<M, N, T> cloth(static_cast<T>(1) / std::max(M, N));
+	Balls<Number, T> balls(ball_radius);
+	cloth.initialize(random);
+	balls.initialize(random);
+	scene.center = balls.center;
+
+	Adaptive_timestep<T> timestep(cloth.quad_size, initial_dt);
+	auto step = [&](const T dt)
+	{
+		Substep_stats<T> stats = scene_granularity ? serial_substep(cloth, balls, dt) : substep(cloth, balls, dt);
+		scene.stats.merge(stats);
+		return stats;
+	};
+
+	scene.substeps = 0;
+	scene.frames.reserve(recorded_frames());
+	scene.frames.push_back(cloth.position);
+	for (int frame = 1; frame <= scene_frames; ++frame)
+	{
+		scene.substeps += advance(frame_time, timestep, step);
+		if (frame % record_interval == 0)
+			scene.frames.push_back(cloth.position);
+	}
+}
+
+template<int M, int N, int Number, typename T>
+inline void Ensemble<M, N, Number, T>::write(const Scene& scene)
+{
+	for (auto& position : scene.frames)
+		recorder.record(position);
+
+	std::fprintf(scene_table, "%llu,%llu,%d,%.9g,%.9g", static_cast<unsigned long long>(scene.index), static_cast<unsigned long long>(seed),
+		scene.substeps, static_cast<double>(scene.stats.max_speed), static_cast<double>(scene.stats.max_strain_rate));
+	for (int k = 0; k < Number; ++k)
+	{
+		std::fprintf(scene_table, ",%.9g,%.9g,%.9g", static_cast<double>(scene.center.coeff(k).x()),
+			static_cast<double>(scene.center.coeff(k).y()), static_cast<double>(scene.center.coeff(k).z()));
+	}
+	std::fprintf(scene_table, "\n");
+}
+
+template<int M, int N, int Number, typename T>
+inline void Ensemble<M, N, Number, T>::run(std::uint64_t first, std::uint64_t count)
+{
+	if (!is_open())
+		return;
+
+	std::uint64_t next = first, end = first + count;
+	tbb::parallel_pipeline(static_cast<size_t>(std::max(max_scenes_in_flight, 1)),
+		tbb::make_filter<void, std::shared_ptr<Scene>>(tbb::filter_mode::serial_in_order, [&](tbb::flow_control& control)
+			{
+				if (next == end)
+				{
+					control.stop();
+					return std::shared_ptr<Scene>();
+				}
+				auto scene = std::make_shared<Scene>();
+				scene->index = next++;
+				return scene;
+			}
+		)
+		& tbb::make_filter<std::shared_ptr<Scene>, std::shared_ptr<Scene>>(tbb::filter_mode::parallel, [this](std::shared_ptr<Scene> scene)
+			{
+				simulate(*scene);
+				return scene;
+			}
+		)
+		// the frames of a scene are released as soon as it is written
+		& tbb::make_filter<std::shared_ptr<Scene>, void>(tbb::filter_mode::serial_in_order, [this](std::shared_ptr<Scene> scene)
+			{
+				write(*scene);
+			}
+		)
+	);
+	std::fflush(scene_table);
+}
+
+#endif
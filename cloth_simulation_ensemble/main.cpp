@@ -0,0 +1,150 @@
+#include "ensemble.h"
+
+#include <tbb/global_control.h>
+#include <tbb/tick_count.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Ensemble runs, one line of results per run:
+//   ./cloth_simulation_ensemble -n 64 -c 1000 -o drops.rec          scenes 0 to 999 of seed 1
+//   ./cloth_simulation_ensemble -n 64 -f 1000 -c 1000 -o more.rec   the next 1000 scenes
+//   ./cloth_simulation_ensemble -n 64 -c 16 --check                  compares scenes with the same scenes run alone
+// -t limits the threads, --seed picks another family of scenes. n is one of 32, 64, 128, 256 and 512,
+// from 256 on the scenes run one after another with the parallel substep.
+
+static constexpr int ball_number = 5;
+static constexpr float ball_radius = 0.6 / ball_number;
+
+struct Options
+{
+    int n = 64;
+    std::uint64_t first = 0;
+    std::uint64_t count = 100;
+    std::uint64_t seed = 1;
+    int threads = 0;
+    std::string path = "ensemble.rec";
+    bool check = false;
+};
+
+template<int n>
+static bool run_ensemble(const Options& options, const std::string& path, std::uint64_t first, std::uint64_t count, bool report)
+{
+    tbb::tick_count start = tbb::tick_count::now();
+    int recorded_frames = 0, max_scenes_in_flight = 0;
+    {
+        Ensemble<n, n, ball_number> ensemble(path, options.seed, ball_radius);
+        if (!ensemble.is_open())
+            return false;
+        recorded_frames = ensemble.recorded_frames();
+        max_scenes_in_flight = ensemble.max_scenes_in_flight;
+        ensemble.run(first, count);
+    }
+    double elapsed = (tbb::tick_count::now() - start).seconds();
+
+    if (report)
+    {
+        std::cout << "ensemble grid " << n << "x" << n << " scenes " << count << " threads " << tbb::global_control::active_value(tbb::global_control::max_allowed_parallelism)
+            << " granularity " << (Ensemble<n, n, ball_number>::scene_granularity ? "scene" : "tile") << " in_flight " << max_scenes_in_flight
+            << " seconds " << elapsed << " scenes_per_hour " << 3600 * count / elapsed
+            << " frames_per_scene " << recorded_frames << " file " << path << std::endl;
+    }
+    return true;
+}
+
+// scenes first to first + count - 1 of the ensemble, and some of them again one at a time on a single thread
+template<int n>
+static int run_check(const Options& options)
+{
+    if (!run_ensemble<n>(options, options.path, options.first, options.count, true))
+        return 1;
+
+    Frame_reader all(options.path);
+    std::vector<float> expected(3 * n * n), actual(3 * n * n);
+    float max_difference = 0;
+    bool read = all.is_open();
+    for (std::uint64_t scene = options.first; read && scene < options.first + options.count; scene += std::max<std::uint64_t>(options.count / 4, 1))
+    {
+        std::string path = options.path + ".check";
+        {
+            tbb::global_control single_thread(tbb::global_control::max_allowed_parallelism, 1);
+            if (!run_ensemble<n>(options, path, scene, 1, false))
+                return 1;
+        }
+        Frame_reader alone(path);
+        read = alone.is_open();
+        uint64_t frames = alone.frame_count();
+        for (uint64_t frame = 0; read && frame < frames; ++frame)
+        {
+            read = all.read_frame((scene - options.first) * frames + frame, expected.data()) && alone.read_frame(frame, actual.data());
+            for (int k = 0; read && k < 3 * n * n; ++k)
+                max_difference = std::max(max_difference, std::abs(expected[k] - actual[k]));
+        }
+        std::remove(path.c_str());
+        std::remove((path + ".scenes.csv").c_str());
+    }
+
+    // with tile granularity the velocity pass depends on the scheduling, as in the demo
+    bool passed = read && (max_difference == 0 || !Ensemble<n, n, ball_number>::scene_granularity);
+    std::cout << "check grid " << n << "x" << n << " scenes " << options.count << " max_difference " << max_difference
+        << (passed ? " PASSED" : " FAILED") << std::endl;
+    return passed ? 0 : 1;
+}
+
+template<int n>
+static int run(const Options& options)
+{
+    if (options.check)
+        return run_check<n>(options);
+    return run_ensemble<n>(options, options.path, options.first, options.count, true) ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int a = 1; a < argc; ++a)
+    {
+        if (!std::strcmp(argv[a], "-n") && a + 1 < argc)
+            options.n = std::atoi(argv[++a]);
+        else if (!std::strcmp(argv[a], "-f") && a + 1 < argc)
+            options.first = std::strtoull(argv[++a], nullptr, 10);
+        else if (!std::strcmp(argv[a], "-c") && a + 1 < argc)
+            options.count = std::strtoull(argv[++a], nullptr, 10);
+        else if (!std::strcmp(argv[a], "-t") && a + 1 < argc)
+            options.threads = std::atoi(argv[++a]);
+        else if (!std::strcmp(argv[a], "-o") && a + 1 < argc)
+            options.path = argv[++a];
+        else if (!std::strcmp(argv[a], "--seed") && a + 1 < argc)
+            options.seed = std::strtoull(argv[++a], nullptr, 10);
+        else if (!std::strcmp(argv[a], "--check"))
+            options.check = true;
+    }
+
+    std::unique_ptr<tbb::global_control> thread_limit;
+    if (options.threads > 0)
+        thread_limit = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, options.threads);
+
+    switch (options.n)
+    {
+    case 32:
+        return run<32>(options);
+    case 64:
+        return run<64>(options);
+    case 128:
+        return run<128>(options);
+    case 256:
+        return run<256>(options);
+    case 512:
+        return run<512>(options);
+    default:
+        std::cout << "ERROR::ENSEMBLE::UNSUPPORTED_GRID: " << options.n << std::endl;
+        return 1;
+    }
+}
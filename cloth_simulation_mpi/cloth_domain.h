@@ -0,0 +1,489 @@
+#pragma once
+#ifndef CLOTH_DOMAIN_H_
+#define CLOTH_DOMAIN_H_
+
+#include <mpi.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range2d.h>
+
+#include "../cloth_simulation_demo/cloth.h"
+
+// MPI datatype of a scalar type
+template<typename T>
+inline MPI_Datatype mpi_type();
+
+template<>
+inline MPI_Datatype mpi_type<float>() { return MPI_FLOAT; }
+
+template<>
+inline MPI_Datatype mpi_type<double>() { return MPI_DOUBLE; }
+
+// The M x N grid of a Cloth split into rectangular blocks, one per rank of a 2d cartesian
+// communicator. Every rank stores its block with a halo of 2 particles around it, the reach of
+// spring_offset, and exchanges the halo with all 8 neighbouring blocks once per substep.
+// The exchange is started first, the particles whose springs stay inside the block are updated
+// while it is in flight, and the band of 2 particles along the block edge comes after it. MPI
+// only moves messages inside its calls, and halo strips of large blocks go past the eager limit,
+// so the interior is updated in progress_polls chunks of columns with MPI_Testall between them.
+//
+// Unlike substep on the whole grid, which updates velocities in place, the spring forces of a
+// substep are all computed from the velocities at its start, the only ones the halo can have.
+// So the result doesn't depend on the number of ranks, or on the order of the updates.
+//
+// The forces are those of update_velocity on a Cloth: gravity, external_force, springs and
+// dashpots. Springs don't tear, there is no counterpart of tear_strain and the springs mask.
+template<typename T = float>
+class Cloth_domain
+{
+public:
+	static constexpr int halo = 2;
+	static constexpr int progress_polls = 8;
+
+	Cloth_domain(int M, int N, const T& quad_size, MPI_Comm comm = MPI_COMM_WORLD);
+	~Cloth_domain();
+
+	// same initial state as Cloth::initialize, the random offset is drawn on rank 0
+	void initialize();
+
+	// one substep of the block; the stats are this rank's only, see advance for global ones
+	template<int Number>
+	Substep_stats<T> substep(const Balls<Number, T>& balls, const T dt);
+
+	// positions of the whole cloth on rank 0, at i * N + j
+	void gather(std::vector<Vector3<T>>& positions) const;
+
+	int rank() const;
+	int size() const;
+	bool valid() const; // false if some block is too small for the halo
+	MPI_Comm communicator() const;
+
+	// particle (i, j) of the block, i and j may reach into the halo
+	Vector3<T>& position_at(int i, int j);
+	Vector3<T>& velocity_at(int i, int j);
+
+public:
+	int M, N;
+	int row_begin, rows; // block of rows owned by this rank
+	int col_begin, cols;
+	T quad_size;
+
+	Array<Vector3<T>, Dynamic, Dynamic> position; // (rows + 2 * halo) x (cols + 2 * halo)
+	Array<Vector3<T>, Dynamic, Dynamic> velocity;
+	Array<Vector3<T>, Dynamic, Dynamic> external_force; // rows x cols without halo, added to gravity in every substep as on Cloth
+
+	double halo_wait_time; // seconds spent waiting for halos, summed over substeps
+
+private:
+	// direction d = (di + 1) * 3 + (dj + 1), 4 is the block itself
+	static int direction(int di, int dj);
+	void send_range(int d, int& i0, int& i1, int& j0, int& j1) const;
+	void receive_range(int d, int& i0, int& i1, int& j0, int& j1) const;
+
+	void start_exchange();
+	void poll_exchange();
+	void finish_exchange();
+
+	void update_velocity(int i, int j, const T dt, Substep_stats<T>& stats);
+	Substep_stats<T> update_velocity(int i0, int i1, int j0, int j1, const T dt);
+
+private:
+	MPI_Comm cart;
+	int neighbour[9];
+	std::vector<T> send_buffer[9];
+	std::vector<T> receive_buffer[9];
+	std::vector<MPI_Request> requests;
+	bool blocks_valid;
+
+	Array<Vector3<T>, Dynamic, Dynamic> next_velocity; // written by update_velocity, swapped with velocity
+};
+
+// copies the colliders of rank 0 to every rank
+template<int Number, typename T>
+void broadcast(Balls<Number, T>& balls, MPI_Comm comm = MPI_COMM_WORLD);
+
+// advance for a Cloth_domain; the substep stats are reduced over all ranks so that every rank
+// picks the same dt
+template<int Number, typename T = float>
+int advance(Cloth_domain<T>& cloth, const Balls<Number, T>& balls, const T frame_time, Adaptive_timestep<T>& timestep);
+
+template<typename T>
+inline Cloth_domain<T>::Cloth_domain(int M, int N, const T& quad_size, MPI_Comm comm) : M(M), N(N), quad_size(quad_size), halo_wait_time(0)
+{
+	int size = 1;
+	MPI_Comm_size(comm, &size);
+	int dims[2] = { 0, 0 }, periods[2] = { 0, 0 };
+	MPI_Dims_create(size, 2, dims);
+	MPI_Cart_create(comm, 2, dims, periods, 0, &cart);
+
+	int coords[2];
+	MPI_Cart_coords(cart, rank(), 2, coords);
+	auto split = [](int length, int parts, int part, int& begin, int& count)
+	{
+		begin = length / parts * part + std::min(part, length % parts);
+		count = length / parts + (part < length % parts ? 1 : 0);
+	};
+	split(M, dims[0], coords[0], row_begin, rows);
+	split(N, dims[1], coords[1], col_begin, cols);
+
+	for (int di = -1; di <= 1; ++di)
+	{
+		for (int dj = -1; dj <= 1; ++dj)
+		{
+			int d = direction(di, dj);
+			int neighbour_coords[2] = { coords[0] + di, coords[1] + dj };
+			neighbour[d] = MPI_PROC_NULL;
+			if (d != 4 && neighbour_coords[0] >= 0 && neighbour_coords[0] < dims[0] && neighbour_coords[1] >= 0 && neighbour_coords[1] < dims[1])
+				MPI_Cart_rank(cart, neighbour_coords, &neighbour[d]);
+		}
+	}
+
+	external_force.resize(rows, cols);
+	external_force.fill(Vector3<T>::Zero());
+	position.resize(rows + 2 * halo, cols + 2 * halo);
+	velocity.resize(rows + 2 * halo, cols + 2 * halo);
+	next_velocity.resize(rows + 2 * halo, cols + 2 * halo);
+	for (int j = 0; j < cols + 2 * halo; ++j)
+	{
+		for (int i = 0; i < rows + 2 * halo; ++i)
+		{
+			position.coeffRef(i, j) = Vector3<T>::Zero();
+			velocity.coeffRef(i, j) = Vector3<T>::Zero();
+			next_velocity.coeffRef(i, j) = Vector3<T>::Zero();
+		}
+	}
+
+	int block_valid = rows >= halo && cols >= halo, all_valid = 0;
+	MPI_Allreduce(&block_valid, &all_valid, 1, MPI_INT, MPI_MIN, cart);
+	blocks_valid = all_valid != 0;
+	if (!blocks_valid && rank() == 0)
+		std::cout << "ERROR::CLOTH_DOMAIN::BLOCK_SMALLER_THAN_HALO: " << M << "x" << N << " on " << dims[0] << "x" << dims[1] << " ranks" << std::endl;
+}
+
+template<typename T>
+inline Cloth_domain<T>::~Cloth_domain()
+{
+	MPI_Comm_free(&cart);
+}
+
+template<typename T>
+inline int Cloth_domain<T>::rank() const
+{
+	int rank = 0;
+	MPI_Comm_rank(cart, &rank);
+	return rank;
+}
+
+template<typename T>
+inline int Cloth_domain<T>::size() const
+{
+	int size = 1;
+	MPI_Comm_size(cart, &size);
+	return size;
+}
+
+template<typename T>
+inline bool Cloth_domain<T>::valid() const
+{
+	return blocks_valid;
+}
+
+template<typename T>
+inline MPI_Comm Cloth_domain<T>::communicator() const
+{
+	return cart;
+}
+
+template<typename T>
+inline Vector3<T>& Cloth_domain<T>::position_at(int i, int j)
+{
+	return position.coeffRef(i + halo, j + halo);
+}
+
+template<typename T>
+inline Vector3<T>& Cloth_domain<T>::velocity_at(int i, int j)
+{
+	return velocity.coeffRef(i + halo, j + halo);
+}
+
+template<typename T>
+inline int Cloth_domain<T>::direction(int di, int dj)
+{
+	return (di + 1) * 3 + (dj + 1);
+}
+
+template<typename T>
+inline void Cloth_domain<T>::send_range(int d, int& i0, int& i1, int& j0, int& j1) const
+{
+	int di = d / 3 - 1, dj = d % 3 - 1;
+	i0 = di > 0 ? rows - halo : 0;
+	i1 = di < 0 ? halo : rows;
+	j0 = dj > 0 ? cols - halo : 0;
+	j1 = dj < 0 ? halo : cols;
+}
+
+template<typename T>
+inline void Cloth_domain<T>::receive_range(int d, int& i0, int& i1, int& j0, int& j1) const
+{
+	int di = d / 3 - 1, dj = d % 3 - 1;
+	i0 = di < 0 ? -halo : (di > 0 ? rows : 0);
+	i1 = di < 0 ? 0 : (di > 0 ? rows + halo : rows);
+	j0 = dj < 0 ? -halo : (dj > 0 ? cols : 0);
+	j1 = dj < 0 ? 0 : (dj > 0 ? cols + halo : cols);
+}
+
+template<typename T>
+inline void Cloth_domain<T>::start_exchange()
+{
+	requests.clear();
+	for (int d = 0; d < 9; ++d)
+	{
+		if (neighbour[d] == MPI_PROC_NULL)
+			continue;
+		int i0, i1, j0, j1;
+		receive_range(d, i0, i1, j0, j1);
+		receive_buffer[d].resize(6 * (i1 - i0) * (j1 - j0));
+		requests.emplace_back();
+		// a block sends towards d with tag d, so what arrives from d was sent towards 8 - d
+		MPI_Irecv(receive_buffer[d].data(), static_cast<int>(receive_buffer[d].size()), mpi_type<T>(), neighbour[d], 8 - d, cart, &requests.back());
+	}
+	for (int d = 0; d < 9; ++d)
+	{
+		if (neighbour[d] == MPI_PROC_NULL)
+			continue;
+		int i0, i1, j0, j1;
+		send_range(d, i0, i1, j0, j1);
+		auto& buffer = send_buffer[d];
+		buffer.resize(6 * (i1 - i0) * (j1 - j0));
+		int index = 0;
+		for (int j = j0; j < j1; ++j)
+		{
+			for (int i = i0; i < i1; ++i, index += 6)
+			{
+				const Vector3<T>& p = position.coeff(i + halo, j + halo);
+				const Vector3<T>& v = velocity.coeff(i + halo, j + halo);
+				std::copy(p.data(), p.data() + 3, buffer.data() + index);
+				std::copy(v.data(), v.data() + 3, buffer.data() + index + 3);
+			}
+		}
+		requests.emplace_back();
+		MPI_Isend(buffer.data(), static_cast<int>(buffer.size()), mpi_type<T>(), neighbour[d], d, cart, &requests.back());
+	}
+}
+
+template<typename T>
+inline void Cloth_domain<T>::poll_exchange()
+{
+	// requests are only released once all of them are done, finish_exchange then returns at once
+	int done = 0;
+	MPI_Testall(static_cast<int>(requests.size()), requests.data(), &done, MPI_STATUSES_IGNORE);
+}
+
+template<typename T>
+inline void Cloth_domain<T>::finish_exchange()
+{
+	double start = MPI_Wtime();
+	MPI_Waitall(static_cast<int>(requests.size()), requests.data(), MPI_STATUSES_IGNORE);
+	halo_wait_time += MPI_Wtime() - start;
+
+	for (int d = 0; d < 9; ++d)
+	{
+		if (neighbour[d] == MPI_PROC_NULL)
+			continue;
+		int i0, i1, j0, j1;
+		receive_range(d, i0, i1, j0, j1);
+		const T* data = receive_buffer[d].data();
+		for (int j = j0; j < j1; ++j)
+		{
+			for (int i = i0; i < i1; ++i, data += 6)
+			{
+				position_at(i, j) = Vector3<T>(data[0], data[1], data[2]);
+				velocity_at(i, j) = Vector3<T>(data[3], data[4], data[5]);
+			}
+		}
+	}
+}
+
+template<typename T>
+inline void Cloth_domain<T>::initialize()
+{
+	T random_offset[2] = { static_cast<T>(0.1 * (dis(generator) - 0.5)), static_cast<T>(0.1 * (dis(generator) - 0.5)) };
+	MPI_Bcast(random_offset, 2, mpi_type<T>(), 0, cart);
+
+	tbb::parallel_for(tbb::blocked_range<int>(0, cols), [&](const tbb::blocked_range<int>& r)
+		{
+			for (int j = r.begin(); j != r.end(); ++j)
+			{
+				for (int i = 0; i < rows; ++i)
+				{
+					position_at(i, j) = Vector3<T>((row_begin + i) * quad_size - 0.5 + random_offset[0], 0.6, (col_begin + j) * quad_size - 0.5 + random_offset[1]);
+					velocity_at(i, j) = Vector3<T>::Zero();
+				}
+			}
+		}
+	);
+}
+
+template<typename T>
+inline void Cloth_domain<T>::update_velocity(int i, int j, const T dt, Substep_stats<T>& stats)
+{
+	Vector3<T> force(external_force.coeff(i, j));
+	force.y() -= gravity;
+	for (auto& offset : spring_offset)
+	{
+		auto& [offset_i, offset_j] = offset;
+		int another_i = i + offset_i;
+		int another_j = j + offset_j;
+		int global_i = row_begin + another_i;
+		int global_j = col_begin + another_j;
+		if (global_i >= 0 && global_i < M && global_j >= 0 && global_j < N)
+		{
+			Vector3<T> x_diff(position_at(i, j) - position_at(another_i, another_j));
+			Vector3<T> v_diff(velocity_at(i, j) - velocity_at(another_i, another_j));
+			T original_dist = quad_size * (Vector2<T>(offset_i, offset_j).norm());
+
+			force += spring_force(x_diff, v_diff, original_dist, quad_size, stats);
+		}
+	}
+
+	next_velocity.coeffRef(i + halo, j + halo) = velocity_at(i, j) + force * dt;
+}
+
+template<typename T>
+inline Substep_stats<T> Cloth_domain<T>::update_velocity(int i0, int i1, int j0, int j1, const T dt)
+{
+	if (i0 >= i1 || j0 >= j1)
+		return Substep_stats<T>();
+	return tbb::parallel_reduce(tbb::blocked_range2d<int>(i0, i1, j0, j1), Substep_stats<T>(), [&](const tbb::blocked_range2d<int>& r, Substep_stats<T> stats)
+		{
+			for (int j = r.cols().begin(); j != r.cols().end(); ++j)
+			{
+				for (int i = r.rows().begin(); i != r.rows().end(); ++i)
+				{
+					update_velocity(i, j, dt, stats);
+				}
+			}
+			return stats;
+		},
+		[](Substep_stats<T> a, const Substep_stats<T>& b) { return a.merge(b); }
+	);
+}
+
+template<typename T>
+template<int Number>
+inline Substep_stats<T> Cloth_domain<T>::substep(const Balls<Number, T>& balls, const T dt)
+{
+	start_exchange();
+
+	// springs of these particles don't reach the halo
+	Substep_stats<T> stats;
+	int chunk = std::max((cols - 2 * halo + progress_polls - 1) / progress_polls, 1);
+	for (int j = halo; j < cols - halo; j += chunk)
+	{
+		stats.merge(update_velocity(halo, rows - halo, j, std::min(j + chunk, cols - halo), dt));
+		poll_exchange();
+	}
+
+	finish_exchange();
+
+	// the band along the edge of the block
+	int top = std::min(halo, rows), bottom = std::max(rows - halo, top);
+	int left = std::min(halo, cols), right = std::max(cols - halo, left);
+	stats.merge(update_velocity(0, top, 0, cols, dt));
+	stats.merge(update_velocity(bottom, rows, 0, cols, dt));
+	stats.merge(update_velocity(top, bottom, 0, left, dt));
+	stats.merge(update_velocity(top, bottom, right, cols, dt));
+	velocity.swap(next_velocity);
+
+	return stats.merge(tbb::parallel_reduce(tbb::blocked_range<int>(0, cols), Substep_stats<T>(), [&](const tbb::blocked_range<int>& r, Substep_stats<T> stats)
+		{
+			for (int j = r.begin(); j != r.end(); ++j)
+			{
+				for (int i = 0; i < rows; ++i)
+				{
+					move_particle(position_at(i, j), velocity_at(i, j), balls, dt, stats);
+				}
+			}
+			return stats;
+		},
+		[](Substep_stats<T> a, const Substep_stats<T>& b) { return a.merge(b); }
+	));
+}
+
+template<typename T>
+inline void Cloth_domain<T>::gather(std::vector<Vector3<T>>& positions) const
+{
+	int ranks = size();
+	int block[4] = { row_begin, rows, col_begin, cols };
+	std::vector<int> blocks(4 * ranks);
+	MPI_Gather(block, 4, MPI_INT, blocks.data(), 4, MPI_INT, 0, cart);
+
+	std::vector<T> local;
+	local.reserve(3 * rows * cols);
+	for (int j = 0; j < cols; ++j)
+	{
+		for (int i = 0; i < rows; ++i)
+		{
+			const Vector3<T>& p = position.coeff(i + halo, j + halo);
+			local.insert(local.end(), p.data(), p.data() + 3);
+		}
+	}
+
+	std::vector<int> counts(ranks), displacements(ranks);
+	for (int r = 0, offset = 0; r < ranks; ++r)
+	{
+		counts[r] = 3 * blocks[4 * r + 1] * blocks[4 * r + 3];
+		displacements[r] = offset;
+		offset += counts[r];
+	}
+	std::vector<T> all(rank() == 0 ? 3 * M * N : 0);
+	MPI_Gatherv(local.data(), static_cast<int>(local.size()), mpi_type<T>(), all.data(), counts.data(), displacements.data(), mpi_type<T>(), 0, cart);
+	if (rank() != 0)
+		return;
+
+	positions.resize(M * N);
+	for (int r = 0; r < ranks; ++r)
+	{
+		const T* data = all.data() + displacements[r];
+		for (int j = 0; j < blocks[4 * r + 3]; ++j)
+		{
+			for (int i = 0; i < blocks[4 * r + 1]; ++i, data += 3)
+				positions[(blocks[4 * r] + i) * N + blocks[4 * r + 2] + j] = Vector3<T>(data[0], data[1], data[2]);
+		}
+	}
+}
+
+template<int Number, typename T>
+inline void broadcast(Balls<Number, T>& balls, MPI_Comm comm)
+{
+	std::vector<T> data(3 * Number + 2);
+	for (int k = 0; k < Number; ++k)
+		std::copy(balls.center.coeff(k).data(), balls.center.coeff(k).data() + 3, data.data() + 3 * k);
+	data[3 * Number] = balls.radius;
+	data[3 * Number + 1] = balls.quad_size_ball;
+	MPI_Bcast(data.data(), static_cast<int>(data.size()), mpi_type<T>(), 0, comm);
+	for (int k = 0; k < Number; ++k)
+		balls.center.coeffRef(k) = Vector3<T>(data[3 * k], data[3 * k + 1], data[3 * k + 2]);
+	balls.radius = data[3 * Number];
+	balls.quad_size_ball = data[3 * Number + 1];
+}
+
+template<int Number, typename T>
+int advance(Cloth_domain<T>& cloth, const Balls<Number, T>& balls, const T frame_time, Adaptive_timestep<T>& timestep)
+{
+	return advance(frame_time, timestep, [&](const T dt)
+		{
+			Substep_stats<T> stats = cloth.substep(balls, dt);
+			T local[2] = { stats.max_speed, stats.max_strain_rate }, global[2];
+			MPI_Allreduce(local, global, 2, mpi_type<T>(), MPI_MAX, cloth.communicator());
+			stats.max_speed = global[0];
+			stats.max_strain_rate = global[1];
+			return stats;
+		}
+	);
+}
+
+#endif
@@ -0,0 +1,165 @@
+#include "cloth_domain.h"
+
+#include <tbb/global_control.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+
+// Benchmark of Cloth_domain, one line of results per run:
+//   mpirun -np 4 ./cloth_simulation_mpi -n 2048 -s 200          strong scaling, 2048 x 2048 in total
+//   mpirun -np 4 ./cloth_simulation_mpi -n 1024 -s 200 --weak   weak scaling, 1024 x 1024 per rank
+//   mpirun -np 4 ./cloth_simulation_mpi --check                  compares with the same cloth in one block
+// scaling.sh runs both series and prints speedup and efficiency.
+
+static constexpr int ball_number = 5;
+static constexpr float ball_radius = 0.6 / ball_number;
+static constexpr int check_n = 64;
+
+static int run_check(int steps)
+{
+    // the same cloth on all ranks and, as reference, on a single block on rank 0
+    Cloth_domain<float> domain(check_n, check_n, 1.0f / check_n);
+    if (!domain.valid())
+        return 1;
+    std::unique_ptr<Cloth_domain<float>> single;
+    if (domain.rank() == 0)
+        single = std::make_unique<Cloth_domain<float>>(check_n, check_n, 1.0f / check_n, MPI_COMM_SELF);
+    generator.seed(7);
+    domain.initialize();
+    generator.seed(7);
+    if (single)
+        single->initialize();
+    Balls<ball_number> balls(ball_radius);
+    balls.initialize();
+    broadcast(balls, domain.communicator());
+
+    // a force varying over the cloth, so that each block must pick its own part of it
+    auto force = [](int i, int j) { return Vector3<float>(std::sin(0.3f * i), 0.f, std::cos(0.2f * j)); };
+    for (int j = 0; j < domain.cols; ++j)
+    {
+        for (int i = 0; i < domain.rows; ++i)
+            domain.external_force(i, j) = force(domain.row_begin + i, domain.col_begin + j);
+    }
+    if (single)
+    {
+        for (int j = 0; j < check_n; ++j)
+        {
+            for (int i = 0; i < check_n; ++i)
+                single->external_force(i, j) = force(i, j);
+        }
+    }
+
+    float dt = 4e-2f / check_n;
+    for (int step = 0; step < steps; ++step)
+    {
+        domain.substep(balls, dt);
+        if (single)
+            single->substep(balls, dt);
+    }
+
+    // then two frames with adaptive substeps; the stats are reduced over the ranks, so every
+    // rank picks the same dt as the single block and the results still match bit for bit
+    Adaptive_timestep<float> timestep(1.0f / check_n, dt), single_timestep(1.0f / check_n, dt);
+    int adaptive_substeps = 0, single_substeps = 0;
+    for (int frame = 0; frame < 2; ++frame)
+    {
+        adaptive_substeps += advance(domain, balls, 1.0f / 60, timestep);
+        if (single)
+            single_substeps += advance(*single, balls, 1.0f / 60, single_timestep);
+    }
+
+    std::vector<Vector3<float>> positions, reference;
+    domain.gather(positions);
+    if (domain.rank() != 0)
+        return 0;
+    single->gather(reference);
+
+    float max_difference = 0;
+    for (int k = 0; k < check_n * check_n; ++k)
+        max_difference = std::max(max_difference, (positions[k] - reference[k]).norm());
+    bool passed = max_difference == 0 && adaptive_substeps == single_substeps;
+    std::cout << "check " << check_n << "x" << check_n << " ranks " << domain.size() << " steps " << steps << " adaptive_substeps " << adaptive_substeps
+        << " max_difference " << max_difference << (passed ? " PASSED" : " FAILED") << std::endl;
+    return passed ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    MPI_Init(&argc, &argv);
+
+    int n = 1024, steps = 100, threads = 1;
+    bool weak = false, check = false;
+    for (int a = 1; a < argc; ++a)
+    {
+        if (!std::strcmp(argv[a], "-n") && a + 1 < argc)
+            n = std::atoi(argv[++a]);
+        else if (!std::strcmp(argv[a], "-s") && a + 1 < argc)
+            steps = std::atoi(argv[++a]);
+        else if (!std::strcmp(argv[a], "-t") && a + 1 < argc)
+            threads = std::atoi(argv[++a]);
+        else if (!std::strcmp(argv[a], "--weak"))
+            weak = true;
+        else if (!std::strcmp(argv[a], "--check"))
+            check = true;
+    }
+
+    // ranks share the cores of the node, so each one runs with few tbb threads
+    tbb::global_control thread_limit(tbb::global_control::max_allowed_parallelism, threads);
+
+    int result = 0;
+    if (check)
+    {
+        result = run_check(steps);
+    }
+    else
+    {
+        int size = 1;
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+        int dims[2] = { 0, 0 };
+        MPI_Dims_create(size, 2, dims);
+        int M = weak ? n * dims[0] : n;
+        int N = weak ? n * dims[1] : n;
+
+        Cloth_domain<float> cloth(M, N, 1.0f / std::max(M, N));
+        if (cloth.valid())
+        {
+            cloth.initialize();
+            Balls<ball_number> balls(ball_radius);
+            balls.initialize();
+            broadcast(balls, cloth.communicator());
+
+            float dt = 4e-2f / std::max(M, N);
+            for (int step = 0; step < 10; ++step) // warm up
+                cloth.substep(balls, dt);
+            cloth.halo_wait_time = 0;
+
+            MPI_Barrier(cloth.communicator());
+            double start = MPI_Wtime();
+            for (int step = 0; step < steps; ++step)
+                cloth.substep(balls, dt);
+            MPI_Barrier(cloth.communicator());
+            double elapsed = MPI_Wtime() - start;
+
+            double max_wait = 0;
+            MPI_Reduce(&cloth.halo_wait_time, &max_wait, 1, MPI_DOUBLE, MPI_MAX, 0, cloth.communicator());
+            if (cloth.rank() == 0)
+            {
+                std::cout << (weak ? "weak" : "strong") << " ranks " << size << " threads " << threads << " grid " << M << "x" << N
+                    << " ms_per_substep " << 1e3 * elapsed / steps
+                    << " particles_per_s " << static_cast<double>(M) * N * steps / elapsed
+                    << " halo_wait_ms " << 1e3 * max_wait / steps << std::endl;
+            }
+        }
+        else
+        {
+            result = 1;
+        }
+    }
+
+    MPI_Finalize();
+    return result;
+}
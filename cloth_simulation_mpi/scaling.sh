@@ -0,0 +1,39 @@
+#!/bin/bash
+# Strong and weak scaling of cloth_simulation_mpi on the local node.
+# usage: ./scaling.sh [max ranks] [strong grid size] [weak grid size per rank] [substeps]
+# MPIRUN_FLAGS is passed to mpirun, by default it restricts Open MPI to shared memory transport.
+
+max_ranks=${1:-4}
+strong_n=${2:-2048}
+weak_n=${3:-1024}
+steps=${4:-100}
+flags=${MPIRUN_FLAGS:---mca btl self,vader}
+binary=$(dirname "$0")/cloth_simulation_mpi
+
+mpirun $flags -np "$max_ranks" "$binary" --check -s 1000 || exit 1
+
+for mode in strong weak; do
+    n=$strong_n
+    extra=""
+    if [ $mode = weak ]; then
+        n=$weak_n
+        extra=--weak
+    fi
+    echo
+    echo "$mode scaling"
+    printf "%6s %12s %16s %14s %9s %11s\n" ranks grid ms/substep halo_wait_ms speedup efficiency
+    base=""
+    ranks=1
+    while [ $ranks -le "$max_ranks" ]; do
+        line=$(mpirun $flags -np $ranks "$binary" -n "$n" -s "$steps" $extra | grep "^$mode")
+        grid=$(echo "$line" | awk '{for (k = 1; k < NF; ++k) if ($k == "grid") print $(k + 1)}')
+        ms=$(echo "$line" | awk '{for (k = 1; k < NF; ++k) if ($k == "ms_per_substep") print $(k + 1)}')
+        wait=$(echo "$line" | awk '{for (k = 1; k < NF; ++k) if ($k == "halo_wait_ms") print $(k + 1)}')
+        base=${base:-$ms}
+        # strong: the same work on more ranks, weak: the same work per rank
+        awk -v mode=$mode -v r=$ranks -v g="$grid" -v t="$ms" -v b="$base" -v w="$wait" 'BEGIN {
+            speedup = mode == "strong" ? b / t : r * b / t
+            printf "%6d %12s %16.3f %14.3f %9.2f %10.0f%%\n", r, g, t, w, speedup, 100 * speedup / r }'
+        ranks=$((ranks * 2))
+    done
+done
@@ -0,0 +1,328 @@
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+
+#include <tbb/global_control.h>
+
+#include <memory>
+#include <string>
+
+#include "../cloth_simulation_demo/cloth.h"
+#include "../cloth_simulation_demo/mesh_cloth.h"
+#include "../cloth_simulation_demo/philox.h"
+
+namespace py = pybind11;
+
+// Cloth and Balls take their sizes as template arguments, so the module is built for a fixed set
+// of them: square cloths of cloth_sizes particles per side and 1 to max_ball_number balls.
+// make_cloth and make_balls pick the class from the size.
+static constexpr int max_ball_number = 8;
+
+template<int... Sizes>
+struct Cloth_sizes
+{
+};
+
+using Built_cloth_sizes = Cloth_sizes<32, 64, 128, 256, 512>;
+
+static std::unique_ptr<tbb::global_control> thread_limit;
+
+// (M, N, 3) array over the memory of a field of the cloth, base keeps the cloth alive
+template<int M, int N, typename T>
+py::array_t<T> alias(Array<Vector3<T>, Dynamic, Dynamic>& field, py::handle base)
+{
+	static_assert(sizeof(Vector3<T>) == 3 * sizeof(T), "Vector3 must be packed for numpy");
+	// eigen stores the grid column major, particle (i, j) is element j * M + i
+	return py::array_t<T>({ static_cast<py::ssize_t>(M), static_cast<py::ssize_t>(N), static_cast<py::ssize_t>(3) },
+		{ static_cast<py::ssize_t>(sizeof(Vector3<T>)), static_cast<py::ssize_t>(sizeof(Vector3<T>) * M), static_cast<py::ssize_t>(sizeof(T)) },
+		field.data()->data(), base);
+}
+
+// (size, 3) array over the memory of a per vertex field of a Mesh_cloth
+template<typename T>
+py::array_t<T> alias(Array<Vector3<T>, Dynamic, 1>& field, py::handle base)
+{
+	return py::array_t<T>({ static_cast<py::ssize_t>(field.size()), static_cast<py::ssize_t>(3) },
+		{ static_cast<py::ssize_t>(sizeof(Vector3<T>)), static_cast<py::ssize_t>(sizeof(T)) },
+		field.data()->data(), base);
+}
+
+void bind_mesh_cloth(py::module_& m)
+{
+	using Mesh_type = Mesh_cloth<float>;
+	// a Mesh_cloth is only made by load or build and never rebuilt, so its arrays keep the size
+	// and the storage the NumPy views of position, velocity and external_force point to
+	py::class_<Mesh_type>(m, "Mesh_cloth")
+		.def_static("load", [](const std::string& path)
+			{
+				auto cloth = std::make_unique<Mesh_type>();
+				if (!cloth->load(path))
+					throw py::value_error("can't make a cloth of the mesh in " + path);
+				return cloth;
+			},
+			py::arg("path"), "new cloth from an OBJ or ASCII PLY file")
+		.def_static("build", [](py::array_t<float, py::array::c_style | py::array::forcecast> positions,
+			py::array_t<unsigned int, py::array::c_style | py::array::forcecast> triangles)
+			{
+				if (positions.ndim() != 2 || positions.shape(1) != 3 || triangles.ndim() != 2 || triangles.shape(1) != 3)
+					throw py::value_error("positions and triangles must have the shapes (vertices, 3) and (triangles, 3)");
+				std::vector<Vector3<float>> points(positions.shape(0));
+				for (py::ssize_t v = 0; v < positions.shape(0); ++v)
+					points[v] = Vector3<float>(positions.at(v, 0), positions.at(v, 1), positions.at(v, 2));
+				std::vector<unsigned int> indices(triangles.data(), triangles.data() + triangles.size());
+				auto cloth = std::make_unique<Mesh_type>();
+				if (!cloth->build(points, indices))
+					throw py::value_error("can't make a cloth of these triangles");
+				return cloth;
+			},
+			py::arg("positions"), py::arg("triangles"), "new cloth from (vertices, 3) positions and (triangles, 3) indices, repeated vertices welded")
+		.def("initialize", &Mesh_type::initialize)
+		.def_property_readonly("vertex_count", &Mesh_type::vertex_count)
+		.def_property_readonly("triangle_count", &Mesh_type::triangle_count)
+		.def_property_readonly("spring_count", &Mesh_type::spring_count)
+		.def_readonly("damping_length", &Mesh_type::damping_length)
+		.def_readonly("min_edge_length", &Mesh_type::min_edge_length)
+		.def("stable_dt", &Mesh_type::stable_dt, "explicit_stable_dt for the springs of the mesh, pass it to Adaptive_timestep")
+		// vertices are in the renumbered order of the loaded mesh, triangles index into it
+		.def_property_readonly("triangles", [](const Mesh_type& cloth)
+			{
+				return py::array_t<unsigned int>({ static_cast<py::ssize_t>(cloth.triangle_count()), static_cast<py::ssize_t>(3) }, cloth.indices.data());
+			}
+		)
+		// writing to these arrays writes to the cloth
+		.def_property_readonly("position", [](py::object self) { return alias<float>(self.cast<Mesh_type&>().position, self); })
+		.def_property_readonly("velocity", [](py::object self) { return alias<float>(self.cast<Mesh_type&>().velocity, self); })
+		.def_property_readonly("external_force", [](py::object self) { return alias<float>(self.cast<Mesh_type&>().external_force, self); });
+}
+
+template<int M>
+void bind_cloth(py::module_& m)
+{
+	using Cloth_type = Cloth<M, M, float>;
+	std::string name = "Cloth" + std::to_string(M);
+	py::class_<Cloth_type>(m, name.c_str())
+		.def(py::init<const float&>(), py::arg("quad_size") = 1.0f / M)
+		.def("initialize", static_cast<void (Cloth_type::*)()>(&Cloth_type::initialize))
+		.def("initialize", [](Cloth_type& cloth, std::uint64_t seed, std::uint64_t stream)
+			{
+				Philox random(seed, stream);
+				cloth.initialize(random);
+			},
+			py::arg("seed"), py::arg("stream") = 0, "random offset from the Philox stream (seed, stream), independent of the global generator")
+		.def_readwrite("quad_size", &Cloth_type::quad_size)
+		.def_readwrite("tear_strain", &Cloth_type::tear_strain)
+		.def_property_readonly("shape", [](const Cloth_type&) { return py::make_tuple(M, M); })
+		// writing to these arrays writes to the cloth
+		.def_property_readonly("position", [](py::object self) { return alias<M, M, float>(self.cast<Cloth_type&>().position, self); })
+		.def_property_readonly("velocity", [](py::object self) { return alias<M, M, float>(self.cast<Cloth_type&>().velocity, self); });
+}
+
+template<int Number>
+void bind_balls(py::module_& m)
+{
+	using Balls_type = Balls<Number, float>;
+	std::string name = "Balls" + std::to_string(Number);
+	py::class_<Balls_type>(m, name.c_str())
+		.def(py::init<const float&>(), py::arg("radius") = 0.6f / Number)
+		.def("initialize", static_cast<void (Balls_type::*)()>(&Balls_type::initialize))
+		.def("initialize", [](Balls_type& balls, std::uint64_t seed, std::uint64_t stream)
+			{
+				Philox random(seed, stream);
+				balls.initialize(random);
+			},
+			py::arg("seed"), py::arg("stream") = 0, "random centers from the Philox stream (seed, stream), independent of the global generator")
+		.def_readwrite("radius", &Balls_type::radius)
+		.def_property_readonly("number", [](const Balls_type&) { return Number; })
+		.def_property_readonly("center", [](py::object self)
+			{
+				Balls_type& balls = self.cast<Balls_type&>();
+				return py::array_t<float>({ static_cast<py::ssize_t>(Number), static_cast<py::ssize_t>(3) },
+					{ static_cast<py::ssize_t>(sizeof(Vector3<float>)), static_cast<py::ssize_t>(sizeof(float)) },
+					balls.center.data()->data(), self);
+			}
+		);
+}
+
+template<int M, int Number>
+void bind_steps(py::module_& m)
+{
+	using Cloth_type = Cloth<M, M, float>;
+	using Balls_type = Balls<Number, float>;
+
+	// the loops run without the gil, so other python threads go on meanwhile; they must not
+	// touch the arrays of this cloth until the call returns
+	m.def("substep", [](Cloth_type& cloth, const Balls_type& balls, float dt, int steps)
+		{
+			Substep_stats<float> stats;
+			py::gil_scoped_release release;
+			for (int step = 0; step < steps; ++step)
+				stats.merge(substep(cloth, balls, dt));
+			return stats;
+		},
+		py::arg("cloth"), py::arg("balls"), py::arg("dt"), py::arg("steps") = 1,
+		"runs steps substeps of dt, returns the maxima over all of them");
+
+	m.def("substep", [](Cloth_type& cloth, const Balls_type& balls, float dt, int steps, Substep_diagnostics<float>& diagnostics)
+		{
+			Substep_stats<float> stats;
+			py::gil_scoped_release release;
+			for (int step = 0; step < steps; ++step)
+				stats.merge(substep(cloth, balls, dt, diagnostics));
+			return stats;
+		},
+		py::arg("cloth"), py::arg("balls"), py::arg("dt"), py::arg("steps"), py::arg("diagnostics"),
+		"same as substep, diagnostics receives the measures of the last substep");
+
+	m.def("serial_substep", [](Cloth_type& cloth, const Balls_type& balls, float dt, int steps)
+		{
+			Substep_stats<float> stats;
+			py::gil_scoped_release release;
+			for (int step = 0; step < steps; ++step)
+				stats.merge(serial_substep(cloth, balls, dt));
+			return stats;
+		},
+		py::arg("cloth"), py::arg("balls"), py::arg("dt"), py::arg("steps") = 1,
+		"same as substep on the calling thread alone, the result doesn't depend on scheduling");
+
+	m.def("advance", [](Cloth_type& cloth, const Balls_type& balls, float frame_time, Adaptive_timestep<float>& timestep, int frames)
+		{
+			int substeps = 0;
+			py::gil_scoped_release release;
+			for (int frame = 0; frame < frames; ++frame)
+				substeps += advance(cloth, balls, frame_time, timestep);
+			return substeps;
+		},
+		py::arg("cloth"), py::arg("balls"), py::arg("frame_time"), py::arg("timestep"), py::arg("frames") = 1,
+		"advances frames frames of frame_time with adaptive substeps, returns the number of substeps");
+}
+
+template<int Number>
+void bind_mesh_steps(py::module_& m)
+{
+	using Mesh_type = Mesh_cloth<float>;
+	using Balls_type = Balls<Number, float>;
+
+	m.def("substep", [](Mesh_type& cloth, const Balls_type& balls, float dt, int steps)
+		{
+			Substep_stats<float> stats;
+			py::gil_scoped_release release;
+			for (int step = 0; step < steps; ++step)
+				stats.merge(substep(cloth, balls, dt));
+			return stats;
+		},
+		py::arg("cloth"), py::arg("balls"), py::arg("dt"), py::arg("steps") = 1,
+		"runs steps substeps of dt on a Mesh_cloth, returns the maxima over all of them");
+
+	m.def("advance", [](Mesh_type& cloth, const Balls_type& balls, float frame_time, Adaptive_timestep<float>& timestep, int frames)
+		{
+			int substeps = 0;
+			py::gil_scoped_release release;
+			for (int frame = 0; frame < frames; ++frame)
+				substeps += advance(frame_time, timestep, [&](const float dt) { return substep(cloth, balls, dt); });
+			return substeps;
+		},
+		py::arg("cloth"), py::arg("balls"), py::arg("frame_time"), py::arg("timestep"), py::arg("frames") = 1,
+		"advances a Mesh_cloth frames frames of frame_time with adaptive substeps, returns the number of substeps");
+}
+
+template<int... Numbers>
+void bind_mesh_steps(py::module_& m, std::integer_sequence<int, Numbers...>)
+{
+	(bind_mesh_steps<Numbers + 1>(m), ...);
+}
+
+template<int M, int... Numbers>
+void bind_steps(py::module_& m, std::integer_sequence<int, Numbers...>)
+{
+	(bind_steps<M, Numbers + 1>(m), ...);
+}
+
+template<int... Numbers>
+void bind_balls(py::module_& m, std::integer_sequence<int, Numbers...>)
+{
+	(bind_balls<Numbers + 1>(m), ...);
+}
+
+template<int... Numbers>
+py::object make_balls(int number, float radius, std::integer_sequence<int, Numbers...>)
+{
+	py::object balls;
+	((number == Numbers + 1 ? (balls = py::cast(new Balls<Numbers + 1, float>(radius), py::return_value_policy::take_ownership), 0) : 0), ...);
+	return balls;
+}
+
+template<int... Sizes>
+void bind_all(py::module_& m, Cloth_sizes<Sizes...>)
+{
+	(bind_cloth<Sizes>(m), ...);
+	bind_balls(m, std::make_integer_sequence<int, max_ball_number>());
+	(bind_steps<Sizes>(m, std::make_integer_sequence<int, max_ball_number>()), ...);
+
+	m.def("make_cloth", [](int n, float quad_size)
+		{
+			py::object cloth;
+			((n == Sizes ? (cloth = py::cast(new Cloth<Sizes, Sizes, float>(quad_size > 0 ? quad_size : 1.0f / Sizes), py::return_value_policy::take_ownership), 0) : 0), ...);
+			if (!cloth)
+				throw py::value_error("cloth size " + std::to_string(n) + " is not built into cloth_solver");
+			return cloth;
+		},
+		py::arg("n"), py::arg("quad_size") = 0.0f, "an n x n Cloth, quad_size defaults to 1 / n");
+}
+
+PYBIND11_MODULE(cloth_solver, m)
+{
+	m.doc() = "headless cloth solver of cloth_simulation_demo";
+
+	py::class_<Substep_stats<float>>(m, "Substep_stats")
+		.def_readonly("max_speed", &Substep_stats<float>::max_speed)
+		.def_readonly("max_strain_rate", &Substep_stats<float>::max_strain_rate);
+
+	py::class_<Substep_diagnostics<float>, Substep_stats<float>>(m, "Substep_diagnostics")
+		.def(py::init<>())
+		.def_readonly("kinetic_energy", &Substep_diagnostics<float>::kinetic_energy)
+		.def_readonly("spring_energy", &Substep_diagnostics<float>::spring_energy)
+		.def_readonly("gravity_energy", &Substep_diagnostics<float>::gravity_energy)
+		.def_property_readonly("total_energy", &Substep_diagnostics<float>::total_energy)
+		// per spring class: structural, shear and bending
+		.def_property_readonly("max_strain", [](const Substep_diagnostics<float>& d) { return py::make_tuple(d.max_strain[0], d.max_strain[1], d.max_strain[2]); })
+		.def_property_readonly("mean_strain", [](const Substep_diagnostics<float>& d) { return py::make_tuple(d.mean_strain(0), d.mean_strain(1), d.mean_strain(2)); })
+		.def_readonly("max_penetration", &Substep_diagnostics<float>::max_penetration)
+		.def_readonly("contacts", &Substep_diagnostics<float>::contacts);
+
+	py::class_<Adaptive_timestep<float>>(m, "Adaptive_timestep")
+		.def(py::init<const float&, const float&>(), py::arg("quad_size"), py::arg("initial_dt"))
+		.def(py::init<const float&, const float&, const float&>(), py::arg("quad_size"), py::arg("initial_dt"), py::arg("stable_dt"))
+		.def_readwrite("dt", &Adaptive_timestep<float>::dt)
+		.def_readwrite("dt_min", &Adaptive_timestep<float>::dt_min)
+		.def_readwrite("dt_max", &Adaptive_timestep<float>::dt_max)
+		.def_readwrite("cfl", &Adaptive_timestep<float>::cfl)
+		.def_readwrite("max_strain_step", &Adaptive_timestep<float>::max_strain_step)
+		.def_readwrite("growth", &Adaptive_timestep<float>::growth);
+
+	bind_all(m, Built_cloth_sizes());
+	bind_mesh_cloth(m);
+	bind_mesh_steps(m, std::make_integer_sequence<int, max_ball_number>());
+
+	m.def("make_balls", [](int number, float radius)
+		{
+			py::object balls = make_balls(number, radius > 0 ? radius : 0.6f / number, std::make_integer_sequence<int, max_ball_number>());
+			if (!balls)
+				throw py::value_error("ball number " + std::to_string(number) + " is not built into cloth_solver");
+			return balls;
+		},
+		py::arg("number"), py::arg("radius") = 0.0f, "Balls of number balls, radius defaults to 0.6 / number");
+
+	m.def("seed", [](unsigned int value) { generator.seed(value); }, py::arg("value"),
+		"seeds the generator behind the random offsets of initialize");
+	m.def("set_threads", [](int threads)
+		{
+			thread_limit.reset();
+			if (threads > 0)
+				thread_limit = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, threads);
+		},
+		py::arg("threads"), "limits the tbb threads of the solver, 0 lifts the limit");
+	m.def("explicit_stable_dt", &explicit_stable_dt<float>, py::arg("quad_size"));
+
+	m.attr("spring_Y") = spring_Y;
+	m.attr("dashpot_damping") = dashpot_damping;
+	m.attr("drag_damping") = drag_damping;
+}
@@ -0,0 +1,205 @@
+"""Parity and performance of cloth_solver against the Taichi reference, cloth_simulation.py.
+
+    python cloth_simulation_python/parity.py                        # grids 32, 64 and 128
+    python cloth_simulation_python/parity.py --sizes 128 256 --threads 4
+    python cloth_simulation_python/parity.py --no-taichi            # only the C++ solver modes
+
+Both solvers start from the state cloth_solver draws from the Philox streams (seed, 0) for the
+cloth and (seed, 1) for the balls, with the same dt, ball radius and constants, and run one scene
+of scene_time seconds. Both update the velocities in place from many threads, so runs differ in
+the order of the updates, and these differences grow once the cloth hits the balls. The
+positions are therefore compared particle by particle in the frames before the first contact,
+which is looked for in every substep, and afterwards only through the centroid and the kinetic
+energy, next to the same measures between the parallel and the serial C++ substep. That
+spread is what any two correct runs differ by.
+
+The performance part reports substeps per second of every C++ solver mode and of Taichi on
+arch=ti.cpu with the same number of threads, one line per grid.
+"""
+import argparse
+import os
+import sys
+import time
+
+import numpy as np
+
+import cloth_solver
+
+ball_number = 5
+ball_radius = 0.6 / ball_number
+
+
+def initial_dt(n):
+    # the dt of main.cpp and cloth_simulation.py, kept below the stability limit of coarse grids
+    return min(4e-2 / n, 0.8 * cloth_solver.explicit_stable_dt(1.0 / n))
+
+
+def make_cpp(n, seed):
+    cloth = cloth_solver.make_cloth(n)
+    balls = cloth_solver.make_balls(ball_number, ball_radius)
+    cloth.initialize(seed, 0)
+    balls.initialize(seed, 1)
+    return cloth, balls
+
+
+class Taichi_scene:
+    def __init__(self, reference, n, cpp_cloth, cpp_balls):
+        self.balls = reference.Balls(ball_number, ball_radius)
+        self.cloth = reference.Cloth(n, self.balls)
+        self.balls.center.from_numpy(np.ascontiguousarray(cpp_balls.center))
+        self.cloth.x.from_numpy(np.ascontiguousarray(cpp_cloth.position))
+        self.cloth.v.from_numpy(np.ascontiguousarray(cpp_cloth.velocity))
+
+    def substep(self, dt, steps):
+        for _ in range(steps):
+            self.cloth.substep(dt)
+
+    @property
+    def position(self):
+        return self.cloth.x.to_numpy()
+
+    @property
+    def velocity(self):
+        return self.cloth.v.to_numpy()
+
+
+def kinetic_energy(velocity):
+    return 0.5 * float(np.sum(velocity.astype(np.float64) ** 2))
+
+
+def centroid(position):
+    return position.reshape(-1, 3).astype(np.float64).mean(axis=0)
+
+
+def parity(n, args, ti, reference):
+    dt = initial_dt(n)
+    frame_substeps = max(1, int(1 / 60 // dt))
+    frames = int(round(args.scene_time * 60))
+    quad_size = 1.0 / n
+
+    parallel, balls = make_cpp(n, args.seed)
+    serial, _ = make_cpp(n, args.seed)
+    taichi = Taichi_scene(reference, n, parallel, balls)
+    diagnostics = cloth_solver.Substep_diagnostics()
+
+    contact_frame = None
+    pointwise = 0.0
+    ordering = {"centroid": 0.0, "kinetic": 0.0}
+    gap = {"centroid": 0.0, "kinetic": 0.0}
+    for frame in range(1, frames + 1):
+        # diagnostics only keep the last substep they measured, so each substep is measured on its
+        # own and a contact that begins and ends within the frame is not missed
+        touched = False
+        for _ in range(frame_substeps):
+            cloth_solver.substep(parallel, balls, dt, 1, diagnostics)
+            touched = touched or diagnostics.contacts > 0
+        cloth_solver.serial_substep(serial, balls, dt, frame_substeps)
+        taichi.substep(dt, frame_substeps)
+        ti.sync()
+
+        # the frame of the first contact is no longer compared particle by particle
+        if contact_frame is None and touched:
+            contact_frame = frame
+        x_taichi = taichi.position
+        if contact_frame is None:
+            pointwise = max(pointwise, float(np.max(np.linalg.norm(x_taichi - serial.position, axis=2))) / quad_size)
+
+        k_serial = kinetic_energy(serial.velocity)
+        ordering["centroid"] = max(ordering["centroid"], np.linalg.norm(centroid(parallel.position) - centroid(serial.position)) / quad_size)
+        ordering["kinetic"] = max(ordering["kinetic"], abs(kinetic_energy(parallel.velocity) - k_serial) / k_serial)
+        gap["centroid"] = max(gap["centroid"], np.linalg.norm(centroid(x_taichi) - centroid(serial.position)) / quad_size)
+        gap["kinetic"] = max(gap["kinetic"], abs(kinetic_energy(taichi.velocity) - k_serial) / k_serial)
+
+    passed = (np.isfinite(pointwise) and pointwise <= args.pointwise_tolerance
+              and gap["centroid"] <= max(args.spread_factor * ordering["centroid"], 1.0))
+    print("parity grid {0}x{0} dt {1:.4g} contact_frame {2} pointwise/quad {3:.3g} centroid/quad {4:.3g} (ordering {5:.3g}) "
+          "kinetic_rel {6:.3g} (ordering {7:.3g}) {8}".format(
+              n, dt, contact_frame, pointwise, gap["centroid"], ordering["centroid"], gap["kinetic"], ordering["kinetic"],
+              "PASSED" if passed else "FAILED"), flush=True)
+    return passed
+
+
+def steps_per_second(run, steps, warmup):
+    run(warmup)
+    start = time.perf_counter()
+    run(steps)
+    return steps / (time.perf_counter() - start)
+
+
+def performance(n, args, ti, reference):
+    dt = initial_dt(n)
+    steps = args.bench_steps
+    warmup = max(1, steps // 10)
+    results = {}
+
+    cloth, balls = make_cpp(n, args.seed)
+    results["parallel"] = steps_per_second(lambda s: cloth_solver.substep(cloth, balls, dt, s), steps, warmup)
+    cloth, balls = make_cpp(n, args.seed)
+    results["serial"] = steps_per_second(lambda s: cloth_solver.serial_substep(cloth, balls, dt, s), steps, warmup)
+    cloth, balls = make_cpp(n, args.seed)
+    diagnostics = cloth_solver.Substep_diagnostics()
+    results["diagnostics"] = steps_per_second(lambda s: cloth_solver.substep(cloth, balls, dt, s, diagnostics), steps, warmup)
+
+    # whole frames with adaptive substeps, counted in substeps
+    cloth, balls = make_cpp(n, args.seed)
+    timestep = cloth_solver.Adaptive_timestep(1.0 / n, dt)
+    frames = max(1, int(steps * dt * 60))
+    cloth_solver.advance(cloth, balls, 1 / 60, timestep, max(1, frames // 10))
+    start = time.perf_counter()
+    substeps = cloth_solver.advance(cloth, balls, 1 / 60, timestep, frames)
+    results["adaptive"] = substeps / (time.perf_counter() - start)
+
+    if reference is not None:
+        cloth, balls = make_cpp(n, args.seed)
+        taichi = Taichi_scene(reference, n, cloth, balls)
+
+        def run(s):
+            taichi.substep(dt, s)
+            ti.sync()
+        results["taichi"] = steps_per_second(run, steps, warmup)
+
+    line = "perf grid {0}x{0} threads {1}".format(n, args.threads if args.threads > 0 else "all")
+    for mode, rate in results.items():
+        line += " {0} {1:.1f}".format(mode, rate)
+        if "taichi" in results and mode != "taichi":
+            line += " ({0:.2f}x)".format(rate / results["taichi"])
+    print(line + " steps/s", flush=True)
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--sizes", type=int, nargs="+", default=[32, 64, 128])
+    parser.add_argument("--seed", type=int, default=7)
+    parser.add_argument("--threads", type=int, default=0, help="threads of both solvers, 0 for all cores")
+    parser.add_argument("--scene-time", type=float, default=1.5, help="simulated seconds of the parity run")
+    parser.add_argument("--bench-steps", type=int, default=600, help="substeps timed per solver mode")
+    parser.add_argument("--pointwise-tolerance", type=float, default=1e-3,
+                        help="largest particle distance before the first contact, in quads")
+    parser.add_argument("--spread-factor", type=float, default=4.0,
+                        help="largest centroid distance relative to the one between the C++ substeps")
+    parser.add_argument("--no-taichi", action="store_true", help="only time the C++ solver modes")
+    parser.add_argument("--no-parity", action="store_true", help="only time the solvers")
+    args = parser.parse_args()
+
+    cloth_solver.set_threads(args.threads)
+    ti = reference = None
+    if not args.no_taichi:
+        import taichi as ti
+        sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+        import cloth_simulation as reference
+        if args.threads > 0:
+            ti.init(arch=ti.cpu, default_fp=ti.f32, cpu_max_num_threads=args.threads)
+        else:
+            ti.init(arch=ti.cpu, default_fp=ti.f32)
+
+    passed = True
+    for n in args.sizes:
+        if reference is not None and not args.no_parity:
+            passed = parity(n, args, ti, reference) and passed
+        performance(n, args, ti, reference)
+    return 0 if passed else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,30 @@
+# builds the cloth_solver module: pip install ./cloth_simulation_python
+# pyproject.toml makes pip install pybind11 before this file is run
+# EIGEN_INCLUDE_DIR and TBB_ROOT point to Eigen and onetbb if they aren't in the default paths
+import os
+
+from pybind11.setup_helpers import Pybind11Extension, build_ext
+from setuptools import setup
+
+include_dirs = [os.environ.get("EIGEN_INCLUDE_DIR", "/usr/include/eigen3")]
+library_dirs = []
+if "TBB_ROOT" in os.environ:
+    include_dirs.append(os.path.join(os.environ["TBB_ROOT"], "include"))
+    library_dirs.append(os.path.join(os.environ["TBB_ROOT"], "lib"))
+
+setup(
+    name="cloth_solver",
+    version="0.1",
+    ext_modules=[
+        Pybind11Extension(
+            "cloth_solver",
+            ["cloth_module.cpp"],
+            include_dirs=include_dirs,
+            library_dirs=library_dirs,
+            libraries=["tbb"],
+            define_macros=[("NDEBUG", None)],
+            cxx_std=17,
+        )
+    ],
+    cmdclass={"build_ext": build_ext},
+)